@@ -0,0 +1,614 @@
+#include "RAY_DeformCache.h"
+
+#include <UT/UT_IStream.h>
+#include <SYS/SYS_Version.h>
+
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <mutex>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+#define CACHE_MAGIC			0x43564558444d4331ULL	// "CVEXDMC1"
+#define CACHE_WAIT_SECONDS	60	// give up on an entry another process is still writing
+#define CACHE_PREFIX		"/cvexdeform_"
+#define CACHE_USAGE_NAME	"/cvexdeform_usage"
+#define CACHE_SHM_DIR		"/dev/shm"	// where shm_open names live on linux, swept for dead entries
+#define VEX_COMPILER		"vcc"
+
+using namespace HDK_Deform;
+
+namespace
+{
+	// state of an entry, written by the creating process
+	enum CacheState
+	{
+		CACHE_WRITING = 0,
+		CACHE_READY = 1,
+		CACHE_FAILED = 2
+	};
+
+	// laid out at the start of every mapping
+	struct CacheHeader
+	{
+		uint64 magic;
+		std::atomic<int> state;
+		int64 size;	// blob bytes counted in the usage, reserved before the blob is written
+	};
+
+	// host-wide bytes held by entries, checked against the cap
+	// only read or written under the registry lock
+	struct UsageHeader
+	{
+		int64 total_bytes;
+	};
+
+	bool theEnabled = false;
+	int64 theCapBytes = 0;
+	UT_StringHolder theFallbackDir;
+	std::atomic<int> theHits(0);
+	std::atomic<int> theMisses(0);
+	std::atomic<int> theFallbacks(0);
+
+	std::atomic<int> theVexHits(0);
+	std::atomic<int> theVexMisses(0);
+	std::atomic<int> theVexFailures(0);
+
+	// 64 bit fnv-1a
+	uint64 hashBytes(const char* data, size_t size, uint64 h = 0xcbf29ce484222325ULL)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			h ^= (uint8)data[i];
+			h *= 0x100000001b3ULL;
+		}
+		return h;
+	}
+
+	uint64 hashString(const char* str)
+	{
+		return hashBytes(str, strlen(str));
+	}
+
+	// output of a program run without a shell, arguments passed as is
+	// stderr goes to the output too when merged; false if it could not run or failed
+	bool readCommand(const std::vector<std::string>& args, std::string& output, bool merge_stderr)
+	{
+#ifndef _WIN32
+		std::vector<char*> argv;
+		for (const auto& arg : args) { argv.push_back(const_cast<char*>(arg.c_str())); }
+		argv.push_back(nullptr);
+		int fds[2];
+		if (pipe(fds) != 0) { return false; }
+		// spawn instead of fork: safe with the render threads running
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+		if (merge_stderr) { posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO); }
+		posix_spawn_file_actions_addclose(&actions, fds[0]);
+		posix_spawn_file_actions_addclose(&actions, fds[1]);
+		pid_t pid;
+		int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+		posix_spawn_file_actions_destroy(&actions);
+		close(fds[1]);
+		if (error != 0)
+		{
+			close(fds[0]);
+			return false;
+		}
+		char buffer[4096];
+		ssize_t n;
+		while ((n = read(fds[0], buffer, sizeof(buffer))) != 0)
+		{
+			if (n > 0) { output.append(buffer, n); }
+			else if (errno != EINTR) { break; }
+		}
+		close(fds[0]);
+		int status;
+		while (waitpid(pid, &status, 0) < 0) { if (errno != EINTR) { return false; } }
+		return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+		return false;
+#endif
+	}
+
+#ifndef _WIN32
+	// an entry lives while some process holds a shared flock on it: the writer holds it exclusively
+	// until the blob is published, readers and the writer keep a shared lock until exit.
+	// the kernel drops the locks of a crashed process, so an entry nobody can be found holding is removed
+	struct Segment
+	{
+		int fd = -1;
+		std::string name;
+		bool is_file = false;	// in the fallback directory
+	};
+
+	inline std::string filePath(const std::string& name)
+	{
+		return std::string(theFallbackDir.c_str()) + name;
+	}
+
+	// shm segment, or a file in the fallback directory when shm is not available
+	int openNamed(const std::string& name, int flags, bool& is_file)
+	{
+		is_file = false;
+		int fd = shm_open(name.c_str(), flags, 0666);
+		if (fd >= 0 || errno == EEXIST || !theFallbackDir.isstring()) { return fd; }
+		is_file = true;
+		return open(filePath(name).c_str(), flags, 0666);
+	}
+
+	void unlinkNamed(const Segment& seg)
+	{
+		if (seg.is_file) { unlink(filePath(seg.name).c_str()); }
+		else { shm_unlink(seg.name.c_str()); }
+	}
+
+	// the name still refers to this segment, not to a newer one created after it was removed
+	bool isLinked(const Segment& seg)
+	{
+		struct stat mine, named;
+		if (fstat(seg.fd, &mine) != 0) { return false; }
+		int fd = seg.is_file ? open(filePath(seg.name).c_str(), O_RDONLY) : shm_open(seg.name.c_str(), O_RDONLY, 0);
+		if (fd < 0) { return false; }
+		// flock belongs to the open file: closing this descriptor keeps ours
+		bool same = fstat(fd, &named) == 0 && named.st_dev == mine.st_dev && named.st_ino == mine.st_ino;
+		close(fd);
+		return same;
+	}
+
+	// bytes the entry behind fd counts in the usage
+	int64 entrySize(int fd)
+	{
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader)) { return 0; }
+		void* addr = mmap(nullptr, sizeof(CacheHeader), PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) { return 0; }
+		const CacheHeader* header = (const CacheHeader*)addr;
+		int64 size = header->magic == CACHE_MAGIC ? header->size : 0;
+		munmap(addr, sizeof(CacheHeader));
+		return size;
+	}
+
+	// host-wide lock around creating, removing and accounting entries
+	// flock serializes processes, the mutex the threads of this process sharing the descriptor
+	struct Registry
+	{
+		UsageHeader* usage = nullptr;
+		int fd = -1;
+		std::mutex lock;
+	};
+
+	Registry& registry()
+	{
+		// opened once per process, lives until exit
+		static Registry* reg = []()
+		{
+			Registry* reg = new Registry;
+			bool is_file;
+			int fd = openNamed(CACHE_USAGE_NAME, O_RDWR | O_CREAT, is_file);
+			struct stat st;
+			// a fresh segment is zero filled: total_bytes starts at 0
+			if (fd >= 0 && fstat(fd, &st) == 0 && 
+				(st.st_size >= (off_t)sizeof(UsageHeader) || ftruncate(fd, sizeof(UsageHeader)) == 0))
+			{
+				void* addr = mmap(nullptr, sizeof(UsageHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (addr != MAP_FAILED)
+				{
+					reg->usage = (UsageHeader*)addr;
+					reg->fd = fd;
+					return reg;
+				}
+			}
+			if (fd >= 0) { close(fd); }
+			return reg;
+		}();
+		return *reg;
+	}
+
+	class RegistryLock
+	{
+	public:
+		RegistryLock() : reg(registry())
+		{
+			reg.lock.lock();
+			flock(reg.fd, LOCK_EX);
+		}
+		~RegistryLock()
+		{
+			flock(reg.fd, LOCK_UN);
+			reg.lock.unlock();
+		}
+		UsageHeader* usage() { return reg.usage; }
+
+	private:
+		Registry& reg;
+	};
+
+	// unlink an entry no other process holds and take its bytes off the usage,
+	// a name that already refers to a newer entry is left alone.
+	// only before closing fd: a failed upgrade drops our shared lock
+	void removeEntry(const Segment& seg)
+	{
+		RegistryLock guard;
+		if (flock(seg.fd, LOCK_EX | LOCK_NB) != 0 || !isLinked(seg)) { return; }
+		// the size is read from this very entry, never from an older one of the same name
+		guard.usage()->total_bytes = SYSmax(guard.usage()->total_bytes - entrySize(seg.fd), (int64)0);
+		unlinkNamed(seg);
+	}
+
+	// entries this process holds, released at exit
+	class CacheRefs
+	{
+	public:
+		~CacheRefs()
+		{
+			for (const auto& seg : refs)
+			{
+				removeEntry(seg);
+				close(seg.fd);
+			}
+		}
+		// takes the descriptor: its shared lock keeps the entry alive
+		void attach(const Segment& seg)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			refs.push_back(seg);
+		}
+
+	private:
+		std::vector<Segment> refs;
+		std::mutex lock;
+	};
+	CacheRefs theRefs;
+
+	// recount the bytes of entries in dir still held by someone, remove the rest
+	// called under the registry lock: no entry is being created or removed meanwhile
+	void sweepEntries(const char* dir, bool is_file, int64& total)
+	{
+		DIR* d = opendir(dir);
+		if (!d) { return; }
+		while (struct dirent* item = readdir(d))
+		{
+			Segment seg;
+			seg.name = std::string("/") + item->d_name;
+			seg.is_file = is_file;
+			if (seg.name.compare(0, strlen(CACHE_PREFIX), CACHE_PREFIX) != 0 || seg.name == CACHE_USAGE_NAME) { continue; }
+			seg.fd = is_file ? open(filePath(seg.name).c_str(), O_RDWR) : shm_open(seg.name.c_str(), O_RDWR, 0);
+			if (seg.fd < 0) { continue; }
+			// every process using it is gone
+			if (flock(seg.fd, LOCK_EX | LOCK_NB) == 0) { unlinkNamed(seg); }
+			else { total += entrySize(seg.fd); }
+			close(seg.fd);
+		}
+		closedir(d);
+	}
+
+	// wait for the writer to publish, false if it takes too long
+	bool lockShared(int fd)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(CACHE_WAIT_SECONDS);
+		while (flock(fd, LOCK_SH | LOCK_NB) != 0)
+		{
+			if (std::chrono::steady_clock::now() > deadline) { return false; }
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return true;
+	}
+
+	// fill a new entry: load the file, reserve host memory, write the blob
+	// an asset over the cap is kept as a failed entry, so no process serializes it again
+	bool createEntry(const Segment& seg, GU_Detail* gd, const UT_StringHolder& file, const RAY_AttribFilter* filter)
+	{
+		bool success = gd->load(file, 0).success();
+		if (success && filter) { filter->apply(gd, file); }
+		CacheHeader* header = nullptr;
+		if (ftruncate(seg.fd, sizeof(CacheHeader)) == 0)
+		{
+			void* addr = mmap(nullptr, sizeof(CacheHeader), PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+			if (addr != MAP_FAILED) { header = (CacheHeader*)addr; }
+		}
+		int state = CACHE_FAILED;
+		if (header)
+		{
+			header->magic = CACHE_MAGIC;
+			header->size = 0;
+			header->state = CACHE_WRITING;
+
+			// a full host cache takes nothing: skip serializing
+			bool fits = false;
+			if (success)
+			{
+				RegistryLock guard;
+				fits = guard.usage()->total_bytes < theCapBytes;
+			}
+			std::string blob;
+			if (fits)
+			{
+				std::ostringstream os;
+				fits = gd->save(os, true, nullptr).success();
+				blob = os.str();
+			}
+			int64 size = (int64)blob.size();
+			fits = fits && size > 0;
+			if (fits)
+			{
+				RegistryLock guard;
+				fits = guard.usage()->total_bytes + size <= theCapBytes;
+				if (fits)
+				{
+					guard.usage()->total_bytes += size;
+					header->size = size;
+				}
+			}
+			if (fits && ftruncate(seg.fd, sizeof(CacheHeader) + size) == 0)
+			{
+				void* addr = mmap(nullptr, sizeof(CacheHeader) + size, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+				if (addr != MAP_FAILED)
+				{
+					memcpy((char*)addr + sizeof(CacheHeader), blob.data(), size);
+					munmap(addr, sizeof(CacheHeader) + size);
+					state = CACHE_READY;
+				}
+			}
+		}
+
+		/// publish, readers waiting on the writer lock go on
+		{
+			RegistryLock guard;
+			if (header)
+			{
+				if (state != CACHE_READY)
+				{
+					guard.usage()->total_bytes -= header->size;
+					header->size = 0;
+				}
+				header->state.store(state, std::memory_order_release);
+				munmap(header, sizeof(CacheHeader));
+			}
+			flock(seg.fd, LOCK_SH);
+		}
+		// held until exit, failed entries too: they keep the decision for the other processes
+		theRefs.attach(seg);
+		return success;
+	}
+
+	// parse an entry written by another process, false if it is not usable
+	bool readEntry(const Segment& seg, GU_Detail* gd)
+	{
+		if (!lockShared(seg.fd)) { return false; }
+		struct stat st;
+		if (fstat(seg.fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader)) { return false; }
+		void* addr = mmap(nullptr, sizeof(CacheHeader), PROT_READ, MAP_SHARED, seg.fd, 0);
+		if (addr == MAP_FAILED) { return false; }
+		const CacheHeader* header = (const CacheHeader*)addr;
+		bool is_valid = header->magic == CACHE_MAGIC;
+		int state = header->state.load(std::memory_order_acquire);
+		int64 size = header->size;
+		munmap(addr, sizeof(CacheHeader));
+		// unlocked while still writing: the writer died
+		if (is_valid && state == CACHE_WRITING)
+		{
+			removeEntry(seg);
+			return false;
+		}
+		// over the cap or unreadable: plain load
+		if (!is_valid || state != CACHE_READY) { return false; }
+		// removed before our lock was granted: not counted in the usage anymore
+		{
+			RegistryLock guard;
+			if (!isLinked(seg)) { return false; }
+		}
+
+		bool success = false;
+		void* data = mmap(nullptr, sizeof(CacheHeader) + size, PROT_READ, MAP_SHARED, seg.fd, 0);
+		if (data != MAP_FAILED)
+		{
+			UT_IStream is((const char*)data + sizeof(CacheHeader), size, UT_ISTREAM_BINARY);
+			success = gd->load(is, nullptr).success();
+			munmap(data, sizeof(CacheHeader) + size);
+		}
+		// the entry outlives its creator while this process holds it
+		if (success) { theRefs.attach(seg); }
+		return success;
+	}
+#endif
+}
+
+void RAY_DeformCache::configure(bool enable, int64 cap_bytes, const UT_StringHolder& fallback_dir)
+{
+	// loads of other instances may already run on the settings: they are written once only
+	static std::once_flag configured;
+	bool is_first = false;
+	std::call_once(configured, [&]()
+	{
+		is_first = true;
+		theEnabled = enable;
+		theCapBytes = cap_bytes;
+		theFallbackDir = fallback_dir;
+#ifndef _WIN32
+		if (theEnabled && registry().usage)
+		{
+			/// recount the usage from live entries, dropping the ones left behind by crashed processes
+			RegistryLock guard;
+			int64 total = 0;
+			sweepEntries(CACHE_SHM_DIR, false, total);
+			if (theFallbackDir.isstring()) { sweepEntries(theFallbackDir.c_str(), true, total); }
+			guard.usage()->total_bytes = total;
+		}
+#endif
+	});
+	if (!is_first && (enable != theEnabled || (enable && (cap_bytes != theCapBytes || fallback_dir != theFallbackDir))))
+	{
+		VRAYwarningOnce("Shared memory cache is configured by the first instancer of this process, other shmCache settings are ignored.");
+	}
+}
+
+bool RAY_DeformCache::isEnabled()
+{
+	return theEnabled;
+}
+
+bool RAY_DeformCache::load(GU_Detail* gd, const UT_StringHolder& file, const RAY_AttribFilter* filter)
+{
+#ifndef _WIN32
+	struct stat st;
+	if (theEnabled && stat(file.c_str(), &st) == 0 && registry().usage)
+	{
+		/// file identity: path, inode, size, mtime, the houdini build that wrote the blob and the attributes kept
+		UT_WorkBuffer identity;
+		identity.sprintf("%s|%lld|%lld|%lld|%lld|%s|%s", file.c_str(), (long long)st.st_dev, (long long)st.st_ino,
+			(long long)st.st_size, (long long)st.st_mtime, SYS_VERSION_FULL, filter ? filter->key().c_str() : "*");
+		UT_WorkBuffer name;
+		name.sprintf(CACHE_PREFIX "%016llx", (unsigned long long)hashString(identity.buffer()));
+		Segment seg;
+		seg.name = name.buffer();
+
+		// created and write locked in one step: a reader never finds an entry without its writer
+		bool created = false;
+		{
+			RegistryLock guard;
+			seg.fd = openNamed(seg.name, O_RDWR | O_CREAT | O_EXCL, seg.is_file);
+			if (seg.fd >= 0)
+			{
+				created = true;
+				flock(seg.fd, LOCK_EX);
+			}
+			else if (errno == EEXIST) { seg.fd = openNamed(seg.name, O_RDWR, seg.is_file); }
+		}
+		if (seg.fd >= 0)
+		{
+			// the descriptor is kept while the entry is used
+			if (created)
+			{
+				theMisses++;
+				return createEntry(seg, gd, file, filter);
+			}
+			if (readEntry(seg, gd)) { theHits++; return true; }
+			close(seg.fd);
+			gd->clearAndDestroy();
+		}
+		theFallbacks++;
+	}
+#endif
+	if (!gd->load(file, 0).success()) { return false; }
+	if (filter) { filter->apply(gd, file); }
+	return true;
+}
+
+void RAY_DeformCache::stats(int& hits, int& misses, int& fallbacks)
+{
+	hits = theHits;
+	misses = theMisses;
+	fallbacks = theFallbacks;
+}
+
+UT_StringHolder RAY_VexCache::resolve(const UT_StringHolder& cvexcmd, const UT_StringHolder& cache_dir, 
+	const UT_StringHolder& compile_flags)
+{
+#ifdef _WIN32
+	return cvexcmd;
+#else
+	if (!cache_dir.isstring()) { return cvexcmd; }
+	UT_String cmd(UT_String::ALWAYS_DEEP, cvexcmd.c_str());
+	char* argv[4096];
+	int argc = cmd.parse(argv, 4096);
+	if (argc < 1) { return cvexcmd; }
+	UT_String program(argv[0]);
+	if (!program.endsWith(".vfl")) { return cvexcmd; }
+
+	// the flags reach vcc exactly as keyed: preprocessing sees the same defines and include paths
+	std::vector<std::string> flags;
+	UT_String flagstr(UT_String::ALWAYS_DEEP, compile_flags.c_str());
+	char* flagv[1024];
+	int flagc = flagstr.parse(flagv, 1024);
+	for (int i = 0; i < flagc; ++i) { flags.push_back(flagv[i]); }
+
+	/// key: preprocessed source (covers #includes), compile flags, houdini build
+	std::string source;
+	std::vector<std::string> preprocess(1, VEX_COMPILER);
+	preprocess.insert(preprocess.end(), flags.begin(), flags.end());
+	preprocess.push_back("-E");
+	preprocess.push_back(argv[0]);
+	if (!readCommand(preprocess, source, false))
+	{
+		// no preprocessor: raw source, includes are not tracked
+		std::ifstream in(argv[0], std::ios::binary);
+		if (!in)
+		{
+			theVexFailures++;
+			return cvexcmd;
+		}
+		std::ostringstream os;
+		os << in.rdbuf();
+		source = os.str();
+	}
+	uint64 h = hashBytes(source.data(), source.size());
+	for (const auto& flag : flags)
+	{
+		// separated: "-a b" and "-ab" differ
+		h = hashBytes(flag.c_str(), flag.size() + 1, h);
+	}
+	const char* build = VEX_COMPILER "|" SYS_VERSION_FULL;
+	h = hashBytes(build, strlen(build), h);
+
+	UT_String basename(program.fileName());
+	basename.truncate(basename.length() - 4);
+	UT_WorkBuffer vexfile;
+	vexfile.sprintf("%s/%s_%016llx.vex", cache_dir.c_str(), basename.c_str(), (unsigned long long)h);
+
+	std::ifstream cached(vexfile.buffer());
+	if (cached.good()) { theVexHits++; }
+	else
+	{
+		/// compile to a private name and rename: concurrent processes never see a partial file
+		theVexMisses++;
+		UT_WorkBuffer tmpfile;
+		tmpfile.sprintf("%s.%d.tmp", vexfile.buffer(), (int)getpid());
+		std::string output;
+		std::vector<std::string> compile(1, VEX_COMPILER);
+		compile.insert(compile.end(), flags.begin(), flags.end());
+		compile.push_back("-o");
+		compile.push_back(tmpfile.buffer());
+		compile.push_back(argv[0]);
+		if (!readCommand(compile, output, true) || std::rename(tmpfile.buffer(), vexfile.buffer()) != 0)
+		{
+			std::remove(tmpfile.buffer());
+			VRAYwarning("Cannot compile %s to the vex cache, loading the source: %s", argv[0], output.c_str());
+			theVexFailures++;
+			return cvexcmd;
+		}
+	}
+
+	/// same command with the compiled program
+	UT_WorkBuffer resolved;
+	resolved.append(vexfile.buffer());
+	for (int i = 1; i < argc; ++i)
+	{
+		resolved.append(' ');
+		resolved.append(argv[i]);
+	}
+	return UT_StringHolder(resolved.buffer());
+#endif
+}
+
+void RAY_VexCache::stats(int& hits, int& misses, int& failures)
+{
+	hits = theVexHits;
+	misses = theVexMisses;
+	failures = theVexFailures;
+}
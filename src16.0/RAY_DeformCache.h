@@ -0,0 +1,45 @@
+#ifndef __RAY_DeformCache__
+#define __RAY_DeformCache__
+
+#include "RAY_Deformer.h"
+
+namespace HDK_Deform
+{
+	// host-wide cache of source geometry shared by concurrent mantra processes
+	// each asset is stored once as an uncompressed binary blob in posix shared memory
+	// (or a file-backed mapping when shm is unavailable), keyed by file identity;
+	// processes map the blob and parse it from memory instead of reading and decompressing the file
+	// an io cache: every process still parses its own detail, the geometry memory itself is not shared
+	// an entry lives while a process holds a flock on it, so entries of crashed processes are reclaimed;
+	// an asset over the host cap is remembered as a failed entry and not serialized again
+	class RAY_DeformCache
+	{
+	public:
+		// process-wide, the first parent procedural sets it: later ones only warn when their settings differ
+		static void configure(bool enable, int64 cap_bytes, const UT_StringHolder& fallback_dir);
+		static bool isEnabled();
+
+		// load file into gd through the cache, plain load when disabled or on any cache failure
+		// with a filter the unread attributes are dropped before the detail is cached, entries are keyed on it
+		static bool load(GU_Detail* gd, const UT_StringHolder& file, const RAY_AttribFilter* filter = nullptr);
+
+		static void stats(int& hits, int& misses, int& fallbacks);
+	};
+
+	// on-disk cache of compiled vex for stages given as .vfl source files
+	// shop paths are compiled by mantra from the scene and are not cached here
+	// programs are compiled once with vcc and stored as .vex, keyed by the preprocessed source,
+	// the compile flags and the houdini build; later renders and sibling processes load the .vex
+	class RAY_VexCache
+	{
+	public:
+		// cvex command with a .vfl program replaced by its cached .vex, compiled on a miss
+		// returns the command unchanged when it is not a vfl file or compilation fails
+		static UT_StringHolder resolve(const UT_StringHolder& cvexcmd, const UT_StringHolder& cache_dir, 
+			const UT_StringHolder& compile_flags);
+
+		static void stats(int& hits, int& misses, int& failures);
+	};
+}
+
+#endif
@@ -1,372 +1,866 @@
-
-#include "RAY_DeformInstance.h"
-#include <UT/UT_DSOVersion.h>
-
-// point cloud
-#define PC_INSTANCEFILE_ATTRIB "instancefile"
-#define PC_ATTRIB_PREFIX "point_"
-
-using namespace HDK_Deform;
-
-//** register procedural
-
-// args
-static VRAY_ProceduralArg        theArgs[] = {
-	VRAY_ProceduralArg("file", "string", ""),
-	VRAY_ProceduralArg("loadPointCloud", "int", "0"),
-	VRAY_ProceduralArg("instance", "int", "0"),
-	VRAY_ProceduralArg("computeN", "int", "0"),
-
-	/// motion blur
-	VRAY_ProceduralArg("velBlur", "int", "0"),
-	VRAY_ProceduralArg("geoTimeSample", "int", "1"),
-
-	/// cvex
-	VRAY_ProceduralArg("cvexnum", "int", "0"),
-	VRAY_ProceduralArg("isMultiThreads", "int", "0"),
-	// cvex list
-	VRAY_ProceduralArg("CVEX1", "string", ""),
-	VRAY_ProceduralArg("CVEX2", "string", ""),
-	VRAY_ProceduralArg("CVEX3", "string", ""),
-	VRAY_ProceduralArg("CVEX4", "string", ""),
-	VRAY_ProceduralArg("CVEX_type1", "int", "0"),
-	VRAY_ProceduralArg("CVEX_type2", "int", "0"),
-	VRAY_ProceduralArg("CVEX_type3", "int", "0"),
-	VRAY_ProceduralArg("CVEX_type4", "int", "0"),
-
-	/// polyframe
-	VRAY_ProceduralArg("prePolyframe", "int", "0"),
-	VRAY_ProceduralArg("postPolyframe1", "int", "0"),
-	VRAY_ProceduralArg("postPolyframe2", "int", "0"),
-	VRAY_ProceduralArg("postPolyframe3", "int", "0"),
-	VRAY_ProceduralArg("postPolyframe4", "int", "0"),
-	// polyframe setup
-	VRAY_ProceduralArg("style", "int", "0"),
-	VRAY_ProceduralArg("which", "int", "1"),
-	VRAY_ProceduralArg("normName", "string", "N"),
-	VRAY_ProceduralArg("tanName", "string", "tangentu"),
-	VRAY_ProceduralArg("bitanName", "string", "tangentv"),
-	VRAY_ProceduralArg("orthogonal", "int", "0"),
-	VRAY_ProceduralArg("leftHanded", "int", "0"),
-	VRAY_ProceduralArg("uvName", "string", ""),
-
-	VRAY_ProceduralArg()
-};
-
-class ProcDef : public VRAY_ProceduralFactory::ProcDefinition
-{
-public:
-	ProcDef()
-		: VRAY_ProceduralFactory::ProcDefinition("deformer")
-	{
-	}
-	virtual VRAY_Procedural      *create() const { return new RAY_DeformInstance(); }
-	virtual VRAY_ProceduralArg   *arguments() const { return theArgs; }
-};
-
-void registerProcedural(VRAY_ProceduralFactory *factory)
-{
-	factory->insert(new ProcDef);
-}
-
-/// --------------------------------------------------------------------------------------------------------
-
-//** parent procedural: deformer instance
-
-RAY_DeformInstance::RAY_DeformInstance()
-{
-	bbox.initBounds(0.0, 0.0, 0.0);
-}
-
-RAY_DeformInstance::~RAY_DeformInstance()
-{
-	//! when delete those memory, each time adjusting parm in deformer without stoping mantra, mantra will crash
-	//for (auto deformer_pt : childDeformer_list)
-	//{
-	//	delete deformer_pt;
-	//}
-	//for (auto attribmap : attribmaps)
-	//{
-	//	delete attribmap;
-	//}
-}
-
-const char* RAY_DeformInstance::className() const
-{
-	return "RAY_DeformInstance";
-}
-
-int RAY_DeformInstance::initialize(const UT_BoundingBox *box)
-{
-	VRAYprintf(0, "=== InstanceDeformer Init ===\n");
-
-	/// input parms
-	UT_StringHolder inputfile;
-	int is_pCloud;
-	int instancenum;
-	int is_compute_normal;
-	int is_velBlur;
-	int geo_timeSample;
-	int cvexnum;
-	int isMultiThreads;
-	/// cvex list
-	std::vector<UT_StringHolder> cvexfiles;
-	std::vector<int> cvex_runtypes;
-	/// polyframe
-	int polyframe_flags[5];	// pre_polyframe, post_polyframe1, post_polyframe2, post_polyframe3, post_polyframe4
-
-	/// load deformer parms
-	// load argvs
-	import("file", inputfile);
-	import("loadPointCloud", &is_pCloud, 1);
-	import("instance", &instancenum, 1);
-	import("computeN", &is_compute_normal, 1);
-	import("cvexnum", &cvexnum, 1);
-	import("isMultiThreads", &isMultiThreads, 1);
-	import("velBlur", &is_velBlur, 1);
-	import("geoTimeSample", &geo_timeSample, 1);
-	fpreal fps = 24.0, camshutter[2] = { 0 };
-	import("global:fps", &fps, 1);
-	import("camera:shutter", camshutter, 2);
-	import("prePolyframe", &polyframe_flags[0], 1);
-	import("postPolyframe1", &polyframe_flags[1], 1);
-	import("postPolyframe2", &polyframe_flags[2], 1);
-	import("postPolyframe3", &polyframe_flags[3], 1);
-	import("postPolyframe4", &polyframe_flags[4], 1);
-	VRAYprintf(0, "Load parm: \n\tfile: %s\n\tis_pCloud: %d\n\tinstance: %d\n\tcvexnum: %d\n\tisMultiThreads: %d\n\tcomputeN: %d\n\tvelBlur: %d\n\tgeoTimeSample: %d\n\tFPS: %f\n\tcamShutter: %f, %f",
-		inputfile.c_str(), is_pCloud, instancenum, cvexnum, isMultiThreads, is_compute_normal, is_velBlur, geo_timeSample, fps, camshutter[0], camshutter[1]);
-	VRAYprintf(0, "Load polyframe enable info: \n\tprePolyframe: %d\n\tpostPolyframe1: %d\n\tpostPolyframe2: %d\n\tpostPolyframe3: %d\n\tpostPolyframe4: %d",
-		polyframe_flags[0], polyframe_flags[1], polyframe_flags[2], polyframe_flags[3], polyframe_flags[4]);
-	
-	// load polyframeParms
-    ///! BUG HERE: somehow set names for tangent and bitangent doesn't work, can only use default names: tangentu/tangentv
-	GU_PolyFrameParms polyframe_parms;
-    UT_StringHolder N_name, tangentu_name, tangentv_name;
-	if (polyframe_flags[0] || polyframe_flags[1] || polyframe_flags[2] || polyframe_flags[3] || polyframe_flags[4])
-	{
-		import("which", &polyframe_parms.which, 1);
-		import("normName", N_name);
-		import("tanName", tangentu_name);
-		import("bitanName", tangentv_name);
-		polyframe_parms.names[0] = tangentu_name.c_str();   // GU_POLYFRAME_TANGENT        = 1,
-		polyframe_parms.names[1] = tangentv_name.c_str();   // GU_POLYFRAME_BITANGENT      = 1 << 1,
-		polyframe_parms.names[2] = N_name.c_str();          // GU_POLYFRAME_NORMAL         = 1 << 2,
-		int orthogonal, left_handed;
-		import("orthogonal", &orthogonal, 1);
-		import("leftHanded", &left_handed, 1);
-		polyframe_parms.orthogonal = (bool)orthogonal;
-		// polyframe_parms.left_handed = (bool)left_handed;     /// hdk16.5
-		int style;
-		import("style", &style, 1);
-		GU_PolyFrameStyle styleHandler[5] = 
-		{ GU_POLYFRAME_FIRST_EDGE, 
-			GU_POLYFRAME_TWO_EDGES, 
-			GU_POLYFRAME_CENTROID, 
-			GU_POLYFRAME_TEXTURE_COORDS, 
-			GU_POLYFRAME_TEXTURE };
-		polyframe_parms.style = styleHandler[style];
-		UT_StringHolder uv_name;
-		import("uvName", uv_name);
-		polyframe_parms.uv_name = uv_name.c_str();
-		VRAYprintf(0, "Load polyframe parm: \n\twhich: %d\n\tnormName: %s, tanName: %s, bitanName: %s\n\torthogonal: %d\n\tleftHanded: %d\n\tstyle: %d\n\tuvName: %s",
-			polyframe_parms.which, polyframe_parms.names[2], polyframe_parms.names[0], polyframe_parms.names[1], orthogonal, left_handed, style, polyframe_parms.uv_name);
-	}
-
-	/// import cvex
-	if (cvexnum > CVEX_MAX_NUM)
-	{
-		VRAYerror("Wrong CVEX number.");
-		return 0;
-	}
-
-	std::string cvex_basename = "CVEX";
-	std::string runtype_basename = "CVEX_type";
-	for (int i = 1; i <= cvexnum; ++i)
-	{
-		UT_StringHolder cvexfile;
-		int runtype;
-		std::string cvex_name = cvex_basename + std::to_string(i);
-		std::string runtype_name = runtype_basename + std::to_string(i);
-
-		// import and store augments
-		if (import(cvex_name.c_str(), cvexfile) && import(runtype_name.c_str(), &runtype, 1))
-		{
-			cvexfiles.push_back(cvexfile);
-			cvex_runtypes.push_back(runtype);
-			VRAYprintf(0, "Import CVEX %s as run type %d.", cvexfile.c_str(), runtype);
-		}
-	}
-
-	///  create child procedurals
-	childDeformer_list.clear();
-	if (!is_pCloud)
-	{
-		CVEXExtraAttribMap cvex_extraAttribMap;	// create extraAttribMap but do nothing
-		for (int instanceid = 0; instanceid < instancenum; ++instanceid)
-		{
-			childDeformer_list.push_back(new RAY_Deform(UT_Vector3(0, 0, 0), inputfile, 
-				cvexfiles, cvex_extraAttribMap, 
-				cvex_runtypes, cvexnum, isMultiThreads, instanceid,
-				is_compute_normal, is_velBlur, geo_timeSample, camshutter[0], camshutter[1], fps, 
-				polyframe_flags, polyframe_parms));
-		}
-	}
-	else
-	{
-		std::vector<UT_Vector3> positions;
-		std::vector<UT_StringHolder> instancefiles;
-		// load point cloud
-		if (!loadPointCloud(inputfile, positions, instancefiles, attribmaps)) { return 0; }
-		assert((positions.size() == instancefiles.size() && positions.size() == attribmaps.size()) 
-			&& "Point cloud positions and instancefiles don't match.");
-		
-		// create instance geo based on point cloud
-		for (int instanceid = 0; instanceid < positions.size(); ++instanceid)
-		{
-			inputfile = instancefiles[instanceid];
-			UT_Vector3 pos = positions[instanceid];
-			CVEXExtraAttribMap attribmap = *(attribmaps[instanceid]);
-			childDeformer_list.push_back(new RAY_Deform(pos, inputfile, 
-				cvexfiles, attribmap,
-				cvex_runtypes, cvexnum, isMultiThreads, instanceid,
-				is_compute_normal, is_velBlur, geo_timeSample, camshutter[0], camshutter[1], fps, 
-				polyframe_flags, polyframe_parms));
-		}
-	}
-
-	return 1;
-}
-
-void RAY_DeformInstance::getBoundingBox(UT_BoundingBox &box)
-{
-	for (auto childProc : childDeformer_list)
-	{
-		childProc->getBoundingBox(bbox);
-	}
-	box = bbox;
-}
-
-void RAY_DeformInstance::render()
-{
-	int instanceid = 0;
-	for (auto childProc : childDeformer_list)
-	{
-		// create a new procedural object
-		VRAY_ProceduralChildPtr obj = createChild();
-		// RAYprintf(0, "Run child procedural instance id: %d ...", instanceid);
-		obj->addProcedural(childProc);
-		// RAYprintf(0, "Run child procedural instance id: %d complete.", instanceid);
-		instanceid++;
-	}
-}
-
-bool RAY_DeformInstance::loadPointCloud(UT_StringHolder& filename, 
-	std::vector<UT_Vector3>& positions, 
-	std::vector<UT_StringHolder>& instancefiles, 
-	std::vector<CVEXExtraAttribMap*>& attribmaps)
-{
-	GU_Detail* gd = new GU_Detail();
-
-	// Load geometry from disk
-	if (!gd->load(filename, 0).success())
-	{
-		VRAYerror("Unable to load point cloud: %s", filename.c_str());
-		return false;
-	}
-
-	int pointNum = gd->getNumPoints();
-	VRAYprintf(0, "Create %d instances based on point cloud.", pointNum);
-	positions.resize(pointNum);
-	instancefiles.resize(pointNum);
-	attribmaps.resize(pointNum);
-
-	// pick pos and instancefile
-	if (!getTypedPointAttrib(gd, "P", positions, pointNum))
-	{
-		VRAYwarning("No position information in point cloud.");
-		return false;
-	}
-	if (!getStringPointAttrib(gd, PC_INSTANCEFILE_ATTRIB, instancefiles, pointNum))
-	{
-		VRAYwarning("No instancefile information in point cloud.");
-		return false;
-	}
-
-	// set attrib map
-	std::vector<GA_Attribute*> geoattriblist;
-	for (GA_AttributeDict::iterator it = gd->pointAttribs().begin(); !it.atEnd(); ++it)
-	{
-		geoattriblist.push_back(it.attrib());
-	}
-	for (int pointid = 0; pointid < pointNum; ++pointid)
-	{
-		CVEXExtraAttribMap* attribmap = new CVEXExtraAttribMap;
-		attribmaps[pointid] = attribmap;
-		for (auto attrib : geoattriblist)
-		{
-			UT_StringHolder binded_attrib_name = std::string(PC_ATTRIB_PREFIX) + attrib->getName().c_str();
-			if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 3)
-			{
-				GA_ROHandleT<fpreal32> handle(gd, GA_ATTRIB_POINT, attrib->getName());
-				GA_Offset off = gd->pointOffset(GA_Index(pointid));
-				if (handle.isValid())
-				{
-					attribmap->floatAttribMap[binded_attrib_name] = handle.get(off);
-				}
-			}
-			else if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 4)
-			{
-				GA_ROHandleT<UT_Vector3> handle(gd, GA_ATTRIB_POINT, attrib->getName());
-				GA_Offset off = gd->pointOffset(GA_Index(pointid));
-				if (handle.isValid())
-				{
-					attribmap->vec3AttribMap[binded_attrib_name] = handle.get(off);
-				}
-			}
-			else if (attrib->getStorageClass() == GA_STORECLASS_FLOAT)
-			{
-				GA_ROHandleT<UT_Vector4> handle(gd, GA_ATTRIB_POINT, attrib->getName());
-				GA_Offset off = gd->pointOffset(GA_Index(pointid));
-				if (handle.isValid())
-				{
-					attribmap->vec4AttribMap[binded_attrib_name] = handle.get(off);
-				}
-			}
-			else if (attrib->getStorageClass() == GA_STORECLASS_INT)
-			{
-				GA_ROHandleT<int> handle(gd, GA_ATTRIB_POINT, attrib->getName());
-				GA_Offset off = gd->pointOffset(GA_Index(pointid));
-				if (handle.isValid())
-				{
-					attribmap->intAttribMap[binded_attrib_name] = handle.get(off);
-				}
-			}
-		}
-	}
-
-	delete gd;
-
-	return true;
-}
-
-bool RAY_DeformInstance::getStringPointAttrib(GU_Detail *gd, UT_StringHolder name, std::vector<UT_StringHolder>& inputlist, int size)
-{
-	GA_ROHandleS handle(gd, GA_ATTRIB_POINT, name);
-	GA_Offset off = gd->pointOffset(GA_Index(0));
-	if (handle.isValid())
-	{
-		const char* attr;
-		for (int i = 0; i < size; ++i)
-		{
-			GA_Offset offset = off + i;
-			attr = handle.get(offset);
-			inputlist[i] = attr;
-		}
-		return true;
-	}
-	else
-	{
-		VRAYwarningOnce("Handle for attribute %s is not valid.", name.c_str());
-		return false;
-	}
-}
+
+#include "RAY_DeformInstance.h"
+#include "RAY_DeformCache.h"
+#include "RAY_DeformKernels.h"
+#include <UT/UT_DSOVersion.h>
+
+// point cloud
+#define PC_INSTANCEFILE_ATTRIB "instancefile"
+#define PC_ATTRIB_PREFIX "point_"
+// optional instance transform attributes, as in Houdini point instancing
+#define PC_ORIENT_ATTRIB "orient"
+#define PC_PSCALE_ATTRIB "pscale"
+#define PC_SCALE_ATTRIB "scale"
+
+using namespace HDK_Deform;
+
+namespace
+{
+	// spread the low 10 bits of v to every third bit
+	inline uint32 expandBits(uint32 v)
+	{
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	// 30 bit morton code of a point normalized into box
+	inline uint32 mortonCode(const UT_Vector3& pos, const UT_BoundingBox& box)
+	{
+		uint32 code = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			fpreal size = box.sizeAxis(axis);
+			fpreal t = size > 0.0 ? (pos(axis) - box.getMin()(axis)) / size : 0.0;
+			uint32 cell = (uint32)SYSclamp(t * 1024.0, 0.0, 1023.0);
+			code |= expandBits(cell) << (2 - axis);
+		}
+		return code;
+	}
+}
+
+//** register procedural
+
+// args
+static VRAY_ProceduralArg        theArgs[] = {
+	VRAY_ProceduralArg("file", "string", ""),
+	VRAY_ProceduralArg("loadPointCloud", "int", "0"),
+	VRAY_ProceduralArg("instance", "int", "0"),
+	VRAY_ProceduralArg("computeN", "int", "0"),
+
+	/// motion blur
+	VRAY_ProceduralArg("velBlur", "int", "0"),
+	VRAY_ProceduralArg("deformVelBlur", "int", "0"),
+	VRAY_ProceduralArg("geoTimeSample", "int", "1"),
+	VRAY_ProceduralArg("batchSegments", "int", "0"),
+
+	/// instance deduplication
+	VRAY_ProceduralArg("dedupInstances", "int", "0"),
+
+	/// share instance-independent leading stages per asset
+	VRAY_ProceduralArg("assetStageCache", "int", "0"),
+
+	/// prefetching loader
+	VRAY_ProceduralArg("prefetchDepth", "int", "0"),
+	VRAY_ProceduralArg("prefetchMemory", "int", "1024"),
+	VRAY_ProceduralArg("ioThreads", "int", "2"),
+
+	/// storage of deformed children waiting for render
+	VRAY_ProceduralArg("compressChildren", "int", "0"),
+
+	/// drop loaded attributes and groups no stage binds, P and keepAttribs patterns stay
+	// trims memory of the deform, prefetch queue and shm cache: the file itself is still read in full
+	VRAY_ProceduralArg("filterAttribs", "int", "0"),
+	VRAY_ProceduralArg("keepAttribs", "string", "N uv Cd Alpha v shop_materialpath material_override"),
+	/// drop every attribute but P and keepAttribs after the stages, 64 bit storage to 32 bit
+	VRAY_ProceduralArg("stripAttribs", "int", "0"),
+
+	/// spatial clusters of children
+	VRAY_ProceduralArg("clusterSize", "int", "0"),
+
+	/// host-wide shared memory geometry cache: saves reading and decompressing, each process still parses its own copy
+	// settings of the first instancer of the process apply to all
+	VRAY_ProceduralArg("shmCache", "int", "0"),
+	VRAY_ProceduralArg("shmCacheMemory", "int", "4096"),
+	VRAY_ProceduralArg("shmCacheDir", "string", "/tmp"),
+
+	/// compiled vex cache for stages given as .vfl files, empty to compile on every render
+	// op: shop paths and .vex files are loaded by mantra as before, they are not cached
+	VRAY_ProceduralArg("vexCacheDir", "string", ""),
+	VRAY_ProceduralArg("vexCompileFlags", "string", ""),	// passed to vcc, part of the cache key
+
+	/// cvex
+	VRAY_ProceduralArg("cvexnum", "int", "0"),
+	VRAY_ProceduralArg("isMultiThreads", "int", "0"),
+	// cvex list
+	VRAY_ProceduralArg("CVEX1", "string", ""),
+	VRAY_ProceduralArg("CVEX2", "string", ""),
+	VRAY_ProceduralArg("CVEX3", "string", ""),
+	VRAY_ProceduralArg("CVEX4", "string", ""),
+	VRAY_ProceduralArg("CVEX_type1", "int", "0"),
+	VRAY_ProceduralArg("CVEX_type2", "int", "0"),
+	VRAY_ProceduralArg("CVEX_type3", "int", "0"),
+	VRAY_ProceduralArg("CVEX_type4", "int", "0"),
+
+	/// polyframe
+	VRAY_ProceduralArg("prePolyframe", "int", "0"),
+	VRAY_ProceduralArg("postPolyframe1", "int", "0"),
+	VRAY_ProceduralArg("postPolyframe2", "int", "0"),
+	VRAY_ProceduralArg("postPolyframe3", "int", "0"),
+	VRAY_ProceduralArg("postPolyframe4", "int", "0"),
+	// polyframe setup
+	VRAY_ProceduralArg("style", "int", "0"),
+	VRAY_ProceduralArg("which", "int", "1"),
+	VRAY_ProceduralArg("normName", "string", "N"),
+	VRAY_ProceduralArg("tanName", "string", "tangentu"),
+	VRAY_ProceduralArg("bitanName", "string", "tangentv"),
+	VRAY_ProceduralArg("orthogonal", "int", "0"),
+	VRAY_ProceduralArg("leftHanded", "int", "0"),
+	VRAY_ProceduralArg("uvName", "string", ""),
+
+	VRAY_ProceduralArg()
+};
+
+class ProcDef : public VRAY_ProceduralFactory::ProcDefinition
+{
+public:
+	ProcDef()
+		: VRAY_ProceduralFactory::ProcDefinition("deformer")
+	{
+	}
+	virtual VRAY_Procedural      *create() const { return new RAY_DeformInstance(); }
+	virtual VRAY_ProceduralArg   *arguments() const { return theArgs; }
+};
+
+void registerProcedural(VRAY_ProceduralFactory *factory)
+{
+	factory->insert(new ProcDef);
+}
+
+/// --------------------------------------------------------------------------------------------------------
+
+//** parent procedural: deformer instance
+
+RAY_DeformInstance::RAY_DeformInstance() :
+	cluster_size(0),
+	is_dedup(0),
+	asset_stage_cache(0),
+	prefetch_depth(0),
+	prefetch_memory(1024),
+	io_threads(2),
+	compress_children(0),
+	interrupt_flag(new std::atomic<bool>(false))
+{
+	bbox.initBounds(0.0, 0.0, 0.0);
+}
+
+RAY_DeformInstance::~RAY_DeformInstance()
+{
+	//! when delete those memory, each time adjusting parm in deformer without stoping mantra, mantra will crash
+	//for (auto deformer_pt : childDeformer_list)
+	//{
+	//	delete deformer_pt;
+	//}
+	//for (auto attribmap : attribmaps)
+	//{
+	//	delete attribmap;
+	//}
+}
+
+const char* RAY_DeformInstance::className() const
+{
+	return "RAY_DeformInstance";
+}
+
+int RAY_DeformInstance::initialize(const UT_BoundingBox *box)
+{
+	VRAYprintf(0, "=== InstanceDeformer Init ===\n");
+
+	/// input parms
+	UT_StringHolder inputfile;
+	int is_pCloud;
+	int instancenum;
+	int is_compute_normal;
+	int is_velBlur;
+	int is_deformVelBlur;
+	int geo_timeSample;
+	int cvexnum;
+	int isMultiThreads;
+	/// cvex list
+	std::vector<UT_StringHolder> cvexfiles;
+	std::vector<int> cvex_runtypes;
+	RAY_DeformKernelList cvex_kernels;
+	std::vector<CVEXStageMask> cvex_masks;
+	/// polyframe
+	int polyframe_flags[5];	// pre_polyframe, post_polyframe1, post_polyframe2, post_polyframe3, post_polyframe4
+
+	/// load deformer parms
+	// load argvs
+	import("file", inputfile);
+	import("loadPointCloud", &is_pCloud, 1);
+	import("instance", &instancenum, 1);
+	import("computeN", &is_compute_normal, 1);
+	import("cvexnum", &cvexnum, 1);
+	import("isMultiThreads", &isMultiThreads, 1);
+	import("velBlur", &is_velBlur, 1);
+	import("deformVelBlur", &is_deformVelBlur, 1);
+	import("geoTimeSample", &geo_timeSample, 1);
+	int batch_segments = 0;
+	import("batchSegments", &batch_segments, 1);
+	import("dedupInstances", &is_dedup, 1);
+	import("assetStageCache", &asset_stage_cache, 1);
+	import("prefetchDepth", &prefetch_depth, 1);
+	import("prefetchMemory", &prefetch_memory, 1);
+	import("ioThreads", &io_threads, 1);
+	import("compressChildren", &compress_children, 1);
+	int filter_attribs = 0;
+	UT_StringHolder keep_attribs;
+	import("filterAttribs", &filter_attribs, 1);
+	import("keepAttribs", keep_attribs);
+	int strip_attribs = 0;
+	import("stripAttribs", &strip_attribs, 1);
+	import("clusterSize", &cluster_size, 1);
+	int shm_cache = 0;
+	int shm_cache_memory = 4096;
+	UT_StringHolder shm_cache_dir;
+	import("shmCache", &shm_cache, 1);
+	import("shmCacheMemory", &shm_cache_memory, 1);
+	import("shmCacheDir", shm_cache_dir);
+	RAY_DeformCache::configure(shm_cache != 0, (int64)shm_cache_memory << 20, shm_cache_dir);
+	fpreal fps = 24.0, camshutter[2] = { 0 };
+	import("global:fps", &fps, 1);
+	import("camera:shutter", camshutter, 2);
+	import("prePolyframe", &polyframe_flags[0], 1);
+	import("postPolyframe1", &polyframe_flags[1], 1);
+	import("postPolyframe2", &polyframe_flags[2], 1);
+	import("postPolyframe3", &polyframe_flags[3], 1);
+	import("postPolyframe4", &polyframe_flags[4], 1);
+	VRAYprintf(0, "Load parm: \n\tfile: %s\n\tis_pCloud: %d\n\tinstance: %d\n\tcvexnum: %d\n\tisMultiThreads: %d\n\tcomputeN: %d\n\tvelBlur: %d\n\tdeformVelBlur: %d\n\tgeoTimeSample: %d\n\tFPS: %f\n\tcamShutter: %f, %f",
+		inputfile.c_str(), is_pCloud, instancenum, cvexnum, isMultiThreads, is_compute_normal, is_velBlur, is_deformVelBlur, geo_timeSample, fps, camshutter[0], camshutter[1]);
+	VRAYprintf(0, "Load polyframe enable info: \n\tprePolyframe: %d\n\tpostPolyframe1: %d\n\tpostPolyframe2: %d\n\tpostPolyframe3: %d\n\tpostPolyframe4: %d",
+		polyframe_flags[0], polyframe_flags[1], polyframe_flags[2], polyframe_flags[3], polyframe_flags[4]);
+	
+	// load polyframeParms
+    ///! BUG HERE: somehow set names for tangent and bitangent doesn't work, can only use default names: tangentu/tangentv
+	GU_PolyFrameParms polyframe_parms;
+    UT_StringHolder N_name, tangentu_name, tangentv_name;
+	if (polyframe_flags[0] || polyframe_flags[1] || polyframe_flags[2] || polyframe_flags[3] || polyframe_flags[4])
+	{
+		import("which", &polyframe_parms.which, 1);
+		import("normName", N_name);
+		import("tanName", tangentu_name);
+		import("bitanName", tangentv_name);
+		polyframe_parms.names[0] = tangentu_name.c_str();   // GU_POLYFRAME_TANGENT        = 1,
+		polyframe_parms.names[1] = tangentv_name.c_str();   // GU_POLYFRAME_BITANGENT      = 1 << 1,
+		polyframe_parms.names[2] = N_name.c_str();          // GU_POLYFRAME_NORMAL         = 1 << 2,
+		int orthogonal, left_handed;
+		import("orthogonal", &orthogonal, 1);
+		import("leftHanded", &left_handed, 1);
+		polyframe_parms.orthogonal = (bool)orthogonal;
+		// polyframe_parms.left_handed = (bool)left_handed;     /// hdk16.5
+		int style;
+		import("style", &style, 1);
+		GU_PolyFrameStyle styleHandler[5] = 
+		{ GU_POLYFRAME_FIRST_EDGE, 
+			GU_POLYFRAME_TWO_EDGES, 
+			GU_POLYFRAME_CENTROID, 
+			GU_POLYFRAME_TEXTURE_COORDS, 
+			GU_POLYFRAME_TEXTURE };
+		polyframe_parms.style = styleHandler[style];
+		UT_StringHolder uv_name;
+		import("uvName", uv_name);
+		polyframe_parms.uv_name = uv_name.c_str();
+		VRAYprintf(0, "Load polyframe parm: \n\twhich: %d\n\tnormName: %s, tanName: %s, bitanName: %s\n\torthogonal: %d\n\tleftHanded: %d\n\tstyle: %d\n\tuvName: %s",
+			polyframe_parms.which, polyframe_parms.names[2], polyframe_parms.names[0], polyframe_parms.names[1], orthogonal, left_handed, style, polyframe_parms.uv_name);
+	}
+
+	/// import cvex
+	if (cvexnum > CVEX_MAX_NUM)
+	{
+		VRAYerror("Wrong CVEX number.");
+		return 0;
+	}
+
+	UT_StringHolder vex_cache_dir;
+	import("vexCacheDir", vex_cache_dir);
+	UT_StringHolder vex_compile_flags;
+	import("vexCompileFlags", vex_compile_flags);
+	std::string cvex_basename = "CVEX";
+	std::string runtype_basename = "CVEX_type";
+	std::string group_basename = "CVEX_group";
+	for (int i = 1; i <= cvexnum; ++i)
+	{
+		UT_StringHolder cvexfile;
+		int runtype;
+		std::string cvex_name = cvex_basename + std::to_string(i);
+		std::string runtype_name = runtype_basename + std::to_string(i);
+
+		// import and store augments
+		if (import(cvex_name.c_str(), cvexfile) && import(runtype_name.c_str(), &runtype, 1))
+		{
+			// native kernel: built once, shared by every child
+			if (RAY_DeformKernel::isNative(cvexfile))
+			{
+				cvex_kernels.push_back(RAY_DeformKernel::create(cvexfile));
+				if (runtype != DO_POINTS) { VRAYwarning("Native kernel %s runs over points only.", cvexfile.c_str()); }
+			}
+			else
+			{
+				// vfl source file: load the compiled program from the cache, other programs are unchanged
+				cvexfile = RAY_VexCache::resolve(cvexfile, vex_cache_dir, vex_compile_flags);
+				cvex_kernels.push_back(nullptr);
+			}
+			cvexfiles.push_back(cvexfile);
+			cvex_runtypes.push_back(runtype);
+			VRAYprintf(0, "Import CVEX %s as run type %d.", cvexfile.c_str(), runtype);
+
+			// optional group or attribute threshold the stage is restricted to
+			UT_StringHolder groupstr;
+			CVEXStageMask mask;
+			import((group_basename + std::to_string(i)).c_str(), groupstr);
+			if (!mask.parse(groupstr))
+			{
+				VRAYerror("Invalid stage mask %s, expected a group name or @attr<op>value, the stage is skipped.", groupstr.c_str());
+			}
+			else if (!mask.isEmpty()) { VRAYprintf(0, "CVEX %d restricted to %s.", i, groupstr.c_str()); }
+			cvex_masks.push_back(mask);
+		}
+	}
+	if (vex_cache_dir.isstring())
+	{
+		int hits, misses, failures;
+		RAY_VexCache::stats(hits, misses, failures);
+		VRAYprintf(0, "Compiled vex cache: %d hits, %d compiled, %d failed.", hits, misses, failures);
+	}
+
+	/// instance deduplication
+	// identical effective inputs deform once, duplicates are placed by transform
+	std::unordered_map<std::string, int> jobmap;
+	std::vector<DeformJob> jobs;
+	int dedup_count = 0;
+	auto addJob = [&](const UT_StringHolder& file, CVEXExtraAttribMap* attribmap, int instanceid, const UT_Matrix4D& xform)
+	{
+		std::string key;
+		if (is_dedup)
+		{
+			key = instanceKey(file, *attribmap, instanceid, xform);
+			auto it = jobmap.find(key);
+			if (it != jobmap.end())
+			{
+				jobs[it->second].xforms.push_back(xform);
+				dedup_count++;
+				return;
+			}
+			jobmap[key] = (int)jobs.size();
+		}
+		DeformJob job;
+		job.file = file;
+		job.attribmap = attribmap;
+		job.instanceid = instanceid;
+		job.xforms.push_back(xform);
+		jobs.push_back(job);
+	};
+
+	/// collect instances
+	CVEXExtraAttribMap cvex_extraAttribMap;	// create extraAttribMap but do nothing
+	if (!is_pCloud)
+	{
+		probeStages(cvexfiles, cvex_extraAttribMap);
+		for (int instanceid = 0; instanceid < instancenum; ++instanceid)
+		{
+			addJob(inputfile, &cvex_extraAttribMap, instanceid, UT_Matrix4D(1.0));
+		}
+	}
+	else
+	{
+		std::vector<UT_Matrix4D> xforms;
+		std::vector<UT_StringHolder> instancefiles;
+		// load point cloud
+		if (!loadPointCloud(inputfile, xforms, instancefiles, attribmaps)) { return 0; }
+		assert((xforms.size() == instancefiles.size() && xforms.size() == attribmaps.size()) 
+			&& "Point cloud positions and instancefiles don't match.");
+		// probe with every extra attribute any instance carries, declared by name and type
+		// a stage reading an extra some instance has is instance dependent for all of them
+		CVEXExtraAttribMap declared;
+		for (const auto attribmap : attribmaps)
+		{
+			for (const auto& attribinfo : attribmap->floatAttribMap)	{ declared.floatAttribMap[attribinfo.first] = 0.0f; }
+			for (const auto& attribinfo : attribmap->intAttribMap)		{ declared.intAttribMap[attribinfo.first] = 0; }
+			for (const auto& attribinfo : attribmap->vec3AttribMap)		{ declared.vec3AttribMap[attribinfo.first] = UT_Vector3(0, 0, 0); }
+			for (const auto& attribinfo : attribmap->vec4AttribMap)		{ declared.vec4AttribMap[attribinfo.first] = UT_Vector4(0, 0, 0, 0); }
+		}
+		probeStages(cvexfiles, declared);
+		
+		// deform in asset space, the point transform is applied to the child at render
+		for (int instanceid = 0; instanceid < xforms.size(); ++instanceid)
+		{
+			addJob(instancefiles[instanceid], attribmaps[instanceid], instanceid, xforms[instanceid]);
+		}
+	}
+	if (is_dedup)
+	{
+		VRAYprintf(0, "Deduplicate instances: %d deformations, %d instances placed from a shared deformation.", 
+			(int)jobs.size(), dedup_count);
+	}
+
+	///  create child procedurals
+	childDeformer_list.clear();
+	childDeformer_list.resize(jobs.size(), nullptr);
+	// states are scoped to this procedural: other instancers rendering alongside keep their own
+	std::shared_ptr<RAY_AssetStages> asset_stages;
+	if (asset_stage_cache) { asset_stages = std::make_shared<RAY_AssetStages>(); }
+	// one filter for every child and the loader: each attribute table is probed once
+	std::shared_ptr<RAY_AttribFilter> attrib_filter;
+	if (filter_attribs)
+	{
+		attrib_filter = RAY_Deform::attribFilter(stageinfos, cvexfiles, cvex_runtypes, cvex_masks, is_velBlur, polyframe_flags, cvexnum, 
+			polyframe_parms, keep_attribs);
+	}
+	auto createDeform = [&](int jobid, GU_Detail* gd)
+	{
+		const DeformJob& job = jobs[jobid];
+		RAY_Deform* deform = new RAY_Deform(job.xforms[0], job.file, gd, 
+			cvexfiles, *(job.attribmap), 
+			cvex_runtypes, cvex_kernels, cvex_masks, stageinfos, cvexnum, isMultiThreads, job.instanceid,
+			is_compute_normal, is_velBlur, is_deformVelBlur, geo_timeSample, batch_segments, asset_stages, compress_children, 
+			attrib_filter, strip_attribs, keep_attribs, camshutter[0], camshutter[1], fps, 
+			polyframe_flags, polyframe_parms, interrupt_flag);
+		for (int i = 1; i < job.xforms.size(); ++i) { deform->addPlacement(job.xforms[i]); }
+		childDeformer_list[jobid] = deform;
+	};
+	// io threads read ahead while workers deform, in job order
+	std::unique_ptr<RAY_DeformLoader> loader;
+	UT_StopWatch timer;
+	timer.start();
+	if (prefetch_depth > 0 && jobs.size() >= 2)
+	{
+		std::vector<UT_StringHolder> jobfiles;
+		for (const auto& job : jobs) { jobfiles.push_back(job.file); }
+		// prefetched details are filtered on the io threads, as the children would
+		loader.reset(new RAY_DeformLoader(jobfiles, attrib_filter.get(), prefetch_depth, (int64)prefetch_memory << 20, io_threads));
+	}
+	int worker_num = (loader && isMultiThreads) ? SYSmin((int)UT_Thread::getNumProcessors(), (int)jobs.size()) : 1;
+	std::atomic<int> ticket(0);
+	std::atomic<int> failed_num(0);
+	std::atomic<int> running_num(worker_num);
+	// drivers block on io: plain threads, so no scheduler worker is held
+	// while the nested parallel loops of the stages need it
+	std::vector<std::thread> drivers;
+	for (int w = 0; w < worker_num; ++w)
+	{
+		drivers.emplace_back([&]()
+		{
+			// tickets are taken in order so the loader never waits on an unclaimed file
+			for (int jobid = ticket++; jobid < (int)jobs.size(); jobid = ticket++)
+			{
+				// stop claiming instances, the loader drops what it read ahead
+				if (*interrupt_flag) { break; }
+				GU_Detail* gd = nullptr;
+				if (loader)
+				{
+					gd = loader->acquire(jobid);
+					// the child would only read the file again
+					if (!gd)
+					{
+						VRAYerror("Unable to prefetch geometry: %s", jobs[jobid].file.c_str());
+						failed_num++;
+						continue;
+					}
+				}
+				createDeform(jobid, gd);
+			}
+			running_num--;
+		});
+	}
+	// UT_Interrupt is only asked from this thread, the drivers and children see the flag
+	UT_Interrupt* boss = UTgetInterrupt();
+	while (running_num > 0)
+	{
+		if (!*interrupt_flag && boss->opInterrupt()) { *interrupt_flag = true; }
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	for (auto& driver : drivers) { driver.join(); }
+	bool is_interrupted = *interrupt_flag;
+	if (loader)
+	{
+		VRAYprintf(0, "Prefetch %d files in %.3fs: workers waited %.3fs on io, peak %.1f MB queued, %d failed.", 
+			(int)jobs.size(), timer.lap(), loader->waitTime(), loader->peakBytes() / (1024.0 * 1024.0), (int)failed_num);
+		loader.reset();
+	}
+
+	if (asset_stages)
+	{
+		VRAYprintf(0, "Asset stage cache: %d states built, %d reused.", (int)asset_stages->builds, (int)asset_stages->hits);
+		// every child has deformed and let go of them: the states are freed with this reference
+		asset_stages.reset();
+	}
+	if (RAY_DeformCache::isEnabled())
+	{
+		int hits, misses, fallbacks;
+		RAY_DeformCache::stats(hits, misses, fallbacks);
+		VRAYprintf(0, "Shared geometry cache: %d hits, %d misses, %d plain loads.", hits, misses, fallbacks);
+	}
+
+	/// interrupted: report discarded work, mantra restarts the render
+	int deformed_num = 0;
+	int discarded_num = 0;
+	int discarded_chunks = 0;
+	for (auto deform : childDeformer_list)
+	{
+		if (!deform) { continue; }
+		if (deform->isInterrupted()) { discarded_num++; }
+		else { deformed_num++; }
+		discarded_chunks += deform->discardedChunks();
+	}
+	if (is_interrupted || discarded_num > 0)
+	{
+		VRAYprintf(0, "Interrupted: %d of %d deformations finished, %d discarded in flight (%d cvex chunks), %d not started.", 
+			deformed_num, (int)jobs.size(), discarded_num, discarded_chunks, (int)jobs.size() - deformed_num - discarded_num);
+		// nothing was handed to mantra yet: the partial work is ours to free
+		for (auto deform : childDeformer_list) { delete deform; }
+		childDeformer_list.clear();
+		for (auto attribmap : attribmaps) { delete attribmap; }
+		attribmaps.clear();
+		return 0;
+	}
+
+	// files that failed to load have no child
+	childDeformer_list.erase(std::remove(childDeformer_list.begin(), childDeformer_list.end(), nullptr), childDeformer_list.end());
+
+	/// spatial clusters
+	buildClusters();
+
+	return 1;
+}
+
+void RAY_DeformInstance::getBoundingBox(UT_BoundingBox &box)
+{
+	for (auto childProc : topProc_list)
+	{
+		childProc->getBoundingBox(bbox);
+	}
+	box = bbox;
+}
+
+void RAY_DeformInstance::render()
+{
+	int instanceid = 0;
+	for (auto childProc : topProc_list)
+	{
+		// create a new procedural object
+		VRAY_ProceduralChildPtr obj = createChild();
+		// RAYprintf(0, "Run child procedural instance id: %d ...", instanceid);
+		obj->addProcedural(childProc);
+		// RAYprintf(0, "Run child procedural instance id: %d complete.", instanceid);
+		instanceid++;
+	}
+}
+
+void RAY_DeformInstance::buildClusters()
+{
+	// a deduplicated child is bound over all its placements, spread across the scene:
+	// it stays at the top level instead of widening the cluster it would land in
+	std::vector<RAY_Deform*> clustered;
+	topProc_list.clear();
+	for (auto deform : childDeformer_list)
+	{
+		if (deform->placementNum() > 1) { topProc_list.push_back(deform); }
+		else { clustered.push_back(deform); }
+	}
+	if (cluster_size < 2 || (int)clustered.size() <= cluster_size)
+	{
+		topProc_list.insert(topProc_list.end(), clustered.begin(), clustered.end());
+		return;
+	}
+
+	/// child bounds, centers and their overall bound
+	int num = (int)clustered.size();
+	std::vector<UT_BoundingBox> boxes(num);
+	UT_BoundingBox center_box;
+	center_box.initBounds();
+	for (int i = 0; i < num; ++i)
+	{
+		boxes[i].initBounds();
+		clustered[i]->getBoundingBox(boxes[i]);
+		center_box.enlargeBounds(boxes[i].center());
+	}
+
+	/// morton order: consecutive children are spatially close at every level
+	std::vector<std::pair<uint32, int>> codes(num);
+	for (int i = 0; i < num; ++i) { codes[i] = std::make_pair(mortonCode(boxes[i].center(), center_box), i); }
+	std::sort(codes.begin(), codes.end());
+	std::vector<VRAY_Procedural*> level(num);
+	std::vector<UT_BoundingBox> level_boxes(num);
+	for (int i = 0; i < num; ++i)
+	{
+		level[i] = clustered[codes[i].second];
+		level_boxes[i] = boxes[codes[i].second];
+	}
+
+	/// group runs of cluster_size until the top level fits in one cluster
+	int cluster_num = 0;
+	int depth = 0;
+	while ((int)level.size() > cluster_size)
+	{
+		std::vector<VRAY_Procedural*> parents;
+		std::vector<UT_BoundingBox> parent_boxes;
+		for (int start = 0; start < (int)level.size(); start += cluster_size)
+		{
+			int end = SYSmin(start + cluster_size, (int)level.size());
+			std::vector<VRAY_Procedural*> procs(level.begin() + start, level.begin() + end);
+			UT_BoundingBox box(level_boxes[start]);
+			for (int i = start + 1; i < end; ++i) { box.enlargeBounds(level_boxes[i]); }
+			parents.push_back(new RAY_DeformCluster(procs, box));
+			parent_boxes.push_back(box);
+		}
+		cluster_num += (int)parents.size();
+		depth++;
+		level.swap(parents);
+		level_boxes.swap(parent_boxes);
+	}
+	int unclustered_num = (int)topProc_list.size();
+	topProc_list.insert(topProc_list.end(), level.begin(), level.end());
+	VRAYprintf(0, "Cluster %d children into %d clusters, %d levels, %d shared deformations left unclustered.", 
+		num, cluster_num, depth, unclustered_num);
+}
+
+bool RAY_DeformInstance::loadPointCloud(UT_StringHolder& filename, 
+	std::vector<UT_Matrix4D>& xforms, 
+	std::vector<UT_StringHolder>& instancefiles, 
+	std::vector<CVEXExtraAttribMap*>& attribmaps)
+{
+	GU_Detail* gd = new GU_Detail();
+
+	// Load geometry from disk
+	if (!gd->load(filename, 0).success())
+	{
+		VRAYerror("Unable to load point cloud: %s", filename.c_str());
+		return false;
+	}
+
+	int pointNum = gd->getNumPoints();
+	VRAYprintf(0, "Create %d instances based on point cloud.", pointNum);
+	std::vector<UT_Vector3> positions(pointNum);
+	xforms.resize(pointNum);
+	instancefiles.resize(pointNum);
+	attribmaps.resize(pointNum);
+
+	// pick pos and instancefile
+	if (!getTypedPointAttrib(gd, "P", positions, pointNum))
+	{
+		VRAYwarning("No position information in point cloud.");
+		return false;
+	}
+	if (!getStringPointAttrib(gd, PC_INSTANCEFILE_ATTRIB, instancefiles, pointNum))
+	{
+		VRAYwarning("No instancefile information in point cloud.");
+		return false;
+	}
+
+	/// instance transform: scale, rotate by orient, then move to P
+	GA_ROHandleV4 orient_h(gd, GA_ATTRIB_POINT, PC_ORIENT_ATTRIB);
+	GA_ROHandleF pscale_h(gd, GA_ATTRIB_POINT, PC_PSCALE_ATTRIB);
+	GA_ROHandleV3 scale_h(gd, GA_ATTRIB_POINT, PC_SCALE_ATTRIB);
+	for (int pointid = 0; pointid < pointNum; ++pointid)
+	{
+		GA_Offset off = gd->pointOffset(GA_Index(pointid));
+		UT_Vector3D scale(1.0, 1.0, 1.0);
+		if (scale_h.isValid()) { scale = UT_Vector3D(scale_h.get(off)); }
+		if (pscale_h.isValid()) { scale *= pscale_h.get(off); }
+		UT_Matrix4D& xform = xforms[pointid];
+		xform.identity();
+		xform.scale(scale.x(), scale.y(), scale.z());
+		if (orient_h.isValid())
+		{
+			UT_Vector4 q = orient_h.get(off);
+			UT_QuaternionD orient(q.x(), q.y(), q.z(), q.w());
+			orient.normalize();
+			UT_Matrix3D rot;
+			orient.getRotationMatrix(rot);
+			xform *= UT_Matrix4D(rot);
+		}
+		xform.translate(UT_Vector3D(positions[pointid]));
+	}
+
+	// set attrib map
+	std::vector<GA_Attribute*> geoattriblist;
+	for (GA_AttributeDict::iterator it = gd->pointAttribs().begin(); !it.atEnd(); ++it)
+	{
+		geoattriblist.push_back(it.attrib());
+	}
+	for (int pointid = 0; pointid < pointNum; ++pointid)
+	{
+		CVEXExtraAttribMap* attribmap = new CVEXExtraAttribMap;
+		attribmaps[pointid] = attribmap;
+		for (auto attrib : geoattriblist)
+		{
+			UT_StringHolder binded_attrib_name = std::string(PC_ATTRIB_PREFIX) + attrib->getName().c_str();
+			if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 3)
+			{
+				GA_ROHandleT<fpreal32> handle(gd, GA_ATTRIB_POINT, attrib->getName());
+				GA_Offset off = gd->pointOffset(GA_Index(pointid));
+				if (handle.isValid())
+				{
+					attribmap->floatAttribMap[binded_attrib_name] = handle.get(off);
+				}
+			}
+			else if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 4)
+			{
+				GA_ROHandleT<UT_Vector3> handle(gd, GA_ATTRIB_POINT, attrib->getName());
+				GA_Offset off = gd->pointOffset(GA_Index(pointid));
+				if (handle.isValid())
+				{
+					attribmap->vec3AttribMap[binded_attrib_name] = handle.get(off);
+				}
+			}
+			else if (attrib->getStorageClass() == GA_STORECLASS_FLOAT)
+			{
+				GA_ROHandleT<UT_Vector4> handle(gd, GA_ATTRIB_POINT, attrib->getName());
+				GA_Offset off = gd->pointOffset(GA_Index(pointid));
+				if (handle.isValid())
+				{
+					attribmap->vec4AttribMap[binded_attrib_name] = handle.get(off);
+				}
+			}
+			else if (attrib->getStorageClass() == GA_STORECLASS_INT)
+			{
+				GA_ROHandleT<int> handle(gd, GA_ATTRIB_POINT, attrib->getName());
+				GA_Offset off = gd->pointOffset(GA_Index(pointid));
+				if (handle.isValid())
+				{
+					attribmap->intAttribMap[binded_attrib_name] = handle.get(off);
+				}
+			}
+		}
+	}
+
+	delete gd;
+
+	return true;
+}
+
+void RAY_DeformInstance::probeStages(const std::vector<UT_StringHolder>& cvexfiles, const CVEXExtraAttribMap& extras)
+{
+	stageinfos.clear();
+	stageinfos.resize(cvexfiles.size());
+	for (int i = 0; i < cvexfiles.size(); ++i)
+	{
+		if (!RAY_Deform::probeCVEX(cvexfiles[i], extras, stageinfos[i]))
+		{
+			// unknown inputs: the stage depends on and may write everything
+			VRAYwarning("Cannot probe CVEX %s, it is not shared, deduplicated or filtered.", cvexfiles[i].c_str());
+			stageinfos[i].probe_failed = true;
+			stageinfos[i].reads_instance = true;
+			stageinfos[i].reads_shutter = true;
+			stageinfos[i].reads_world = true;
+		}
+	}
+}
+
+std::string RAY_DeformInstance::instanceKey(const UT_StringHolder& file, const CVEXExtraAttribMap& attribmap, int instanceid, const UT_Matrix4D& xform)
+{
+	// effective deformation inputs: file, instance id if read, values of the extra attributes read
+	// extras come from the probed parameters of the stage, an instance without one is keyed as such
+	UT_WorkBuffer key;
+	key.append(file.c_str());
+	for (int i = 0; i < stageinfos.size(); ++i)
+	{
+		const CVEXStageInfo& info = stageinfos[i];
+		key.appendSprintf("|%d", i);
+		if (info.reads_instance) { key.appendSprintf("|instance=%d", instanceid); }
+		if (info.reads_world)
+		{
+			key.append("|xform=");
+			for (int r = 0; r < 4; ++r)
+			{
+				for (int c = 0; c < 4; ++c) { key.appendSprintf("%.17g,", xform(r, c)); }
+			}
+		}
+		for (const auto& name : info.params)
+		{
+			auto fit = attribmap.floatAttribMap.find(name);
+			if (fit != attribmap.floatAttribMap.end()) { key.appendSprintf("|%s=%.9g", name.c_str(), fit->second); continue; }
+			auto iit = attribmap.intAttribMap.find(name);
+			if (iit != attribmap.intAttribMap.end()) { key.appendSprintf("|%s=%d", name.c_str(), iit->second); continue; }
+			auto v3it = attribmap.vec3AttribMap.find(name);
+			if (v3it != attribmap.vec3AttribMap.end())
+			{
+				const UT_Vector3& v = v3it->second;
+				key.appendSprintf("|%s=%.9g,%.9g,%.9g", name.c_str(), v.x(), v.y(), v.z());
+				continue;
+			}
+			auto v4it = attribmap.vec4AttribMap.find(name);
+			if (v4it != attribmap.vec4AttribMap.end())
+			{
+				const UT_Vector4& v = v4it->second;
+				key.appendSprintf("|%s=%.9g,%.9g,%.9g,%.9g", name.c_str(), v.x(), v.y(), v.z(), v.w());
+				continue;
+			}
+			key.appendSprintf("|%s=-", name.c_str());
+		}
+	}
+	return std::string(key.buffer());
+}
+
+bool RAY_DeformInstance::getStringPointAttrib(GU_Detail *gd, UT_StringHolder name, std::vector<UT_StringHolder>& inputlist, int size)
+{
+	GA_ROHandleS handle(gd, GA_ATTRIB_POINT, name);
+	GA_Offset off = gd->pointOffset(GA_Index(0));
+	if (handle.isValid())
+	{
+		const char* attr;
+		for (int i = 0; i < size; ++i)
+		{
+			GA_Offset offset = off + i;
+			attr = handle.get(offset);
+			inputlist[i] = attr;
+		}
+		return true;
+	}
+	else
+	{
+		VRAYwarningOnce("Handle for attribute %s is not valid.", name.c_str());
+		return false;
+	}
+}
+
+/// --------------------------------------------------------------------------------------------------------
+
+//** intermediate procedural: cluster of instances
+
+RAY_DeformCluster::RAY_DeformCluster(const std::vector<VRAY_Procedural*>& procs, const UT_BoundingBox& box) :
+	children(procs), 
+	bbox(box)
+{
+}
+
+RAY_DeformCluster::~RAY_DeformCluster()
+{
+}
+
+const char* RAY_DeformCluster::className() const
+{
+	return "RAY_DeformCluster";
+}
+
+// cluster procedural: this function never be called
+int RAY_DeformCluster::initialize(const UT_BoundingBox *box)
+{
+	return 0;
+}
+
+void RAY_DeformCluster::getBoundingBox(UT_BoundingBox &box)
+{
+	box.enlargeBounds(bbox);
+}
+
+void RAY_DeformCluster::render()
+{
+	for (auto childProc : children)
+	{
+		VRAY_ProceduralChildPtr obj = createChild();
+		obj->addProcedural(childProc);
+	}
+}
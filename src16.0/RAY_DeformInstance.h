@@ -1,61 +1,109 @@
-
-#ifndef __RAY_DeformInstance__
-#define __RAY_DeformInstance__
-
-#include "RAY_Deformer.h"
-
-namespace HDK_Deform
-{
-	class RAY_Deform;
-
-	class RAY_DeformInstance : public VRAY_Procedural {
-	public:
-		RAY_DeformInstance();
-		virtual ~RAY_DeformInstance();
-		virtual const char *className() const;
-		virtual int initialize(const UT_BoundingBox *);
-		virtual void getBoundingBox(UT_BoundingBox &box);
-		virtual void render();
-
-	private:
-		/// geom boundingbox
-		UT_BoundingBox bbox;
-		/// child procedural list
-		std::vector<RAY_Deform*> childDeformer_list;
-		/// extra attribute map
-		std::vector<CVEXExtraAttribMap*> attribmaps;
-
-		bool loadPointCloud(UT_StringHolder& filename, 
-			std::vector<UT_Vector3>& positions, 
-			std::vector<UT_StringHolder>& instancefiles, 
-			std::vector<CVEXExtraAttribMap*>& attribmaps);
-
-		// get attrib value
-		bool getStringPointAttrib(GU_Detail *gd, UT_StringHolder name, std::vector<UT_StringHolder>& inputlist, int size);
-		template <typename T>
-		inline bool getTypedPointAttrib(GU_Detail *gd, UT_StringHolder name, std::vector<T>& inputlist, int size)
-		{
-			GA_ROHandleT<T> handle(gd, GA_ATTRIB_POINT, name);
-			GA_Offset off = gd->pointOffset(GA_Index(0));
-			if (handle.isValid())
-			{
-				T attr;
-				for (int i = 0; i < size; ++i)
-				{
-					GA_Offset offset = off + i;
-					attr = handle.get(offset);
-					inputlist[i] = attr;
-				}
-				return true;
-			}
-			else
-			{
-				VRAYwarningOnce("Handle for attribute %s is not valid.", name.c_str());
-				return false;
-			}
-		}
-
-	};
-}
-
-#endif
+
+#ifndef __RAY_DeformInstance__
+#define __RAY_DeformInstance__
+
+#include "RAY_Deformer.h"
+#include "RAY_DeformLoader.h"
+
+namespace HDK_Deform
+{
+	class RAY_Deform;
+
+	// intermediate procedural of spatially close instances: mantra expands it only when its bound is hit
+	class RAY_DeformCluster : public VRAY_Procedural {
+	public:
+		RAY_DeformCluster(const std::vector<VRAY_Procedural*>& procs, const UT_BoundingBox& box);
+		virtual ~RAY_DeformCluster();
+		virtual const char *className() const;
+		virtual int initialize(const UT_BoundingBox *);
+		virtual void getBoundingBox(UT_BoundingBox &box);
+		virtual void render();
+
+	private:
+		std::vector<VRAY_Procedural*> children;	// deformers or nested clusters
+		UT_BoundingBox bbox;
+	};
+
+	class RAY_DeformInstance : public VRAY_Procedural {
+	public:
+		RAY_DeformInstance();
+		virtual ~RAY_DeformInstance();
+		virtual const char *className() const;
+		virtual int initialize(const UT_BoundingBox *);
+		virtual void getBoundingBox(UT_BoundingBox &box);
+		virtual void render();
+
+	private:
+		/// geom boundingbox
+		UT_BoundingBox bbox;
+		/// child procedural list
+		std::vector<RAY_Deform*> childDeformer_list;
+		/// cluster hierarchy over the children, top level is added in render
+		int cluster_size;	// max procedurals per cluster, 0: flat list of children
+		std::vector<VRAY_Procedural*> topProc_list;
+		/// extra attribute map
+		std::vector<CVEXExtraAttribMap*> attribmaps;
+		/// instance deduplication
+		int is_dedup;
+		int asset_stage_cache;	// share instance-independent leading stages per asset
+		/// prefetching loader
+		int prefetch_depth;		// 0: each child loads its own file
+		int prefetch_memory;	// MB of loaded geometry waiting for a deform worker
+		int io_threads;
+		/// storage of deformed children waiting for render: 0-off, 1-constant pages, 2-fp16 attribs, 3-fp16 P too
+		int compress_children;
+		std::vector<CVEXStageInfo> stageinfos;	// inputs read by each cvex stage, probed once and handed to every child
+		// raised on interrupt by initialize's thread, polled by the deform drivers and children
+		std::shared_ptr<std::atomic<bool>> interrupt_flag;
+
+		// one deformation to build: a unique instance and the placements sharing it
+		struct DeformJob
+		{
+			UT_StringHolder file;
+			CVEXExtraAttribMap* attribmap;
+			int instanceid;
+			std::vector<UT_Matrix4D> xforms;	// first one is the instance's own transform
+		};
+
+		// group children into morton ordered clusters, level by level
+		void buildClusters();
+
+		bool loadPointCloud(UT_StringHolder& filename, 
+			std::vector<UT_Matrix4D>& xforms, 
+			std::vector<UT_StringHolder>& instancefiles, 
+			std::vector<CVEXExtraAttribMap*>& attribmaps);
+
+		// find the inputs each cvex stage reads, one load per stage for all instances
+		void probeStages(const std::vector<UT_StringHolder>& cvexfiles, const CVEXExtraAttribMap& extras);
+		// key of the effective deformation inputs of an instance
+		std::string instanceKey(const UT_StringHolder& file, const CVEXExtraAttribMap& attribmap, int instanceid, const UT_Matrix4D& xform);
+
+		// get attrib value
+		bool getStringPointAttrib(GU_Detail *gd, UT_StringHolder name, std::vector<UT_StringHolder>& inputlist, int size);
+		template <typename T>
+		inline bool getTypedPointAttrib(GU_Detail *gd, UT_StringHolder name, std::vector<T>& inputlist, int size)
+		{
+			GA_ROHandleT<T> handle(gd, GA_ATTRIB_POINT, name);
+			GA_Offset off = gd->pointOffset(GA_Index(0));
+			if (handle.isValid())
+			{
+				T attr;
+				for (int i = 0; i < size; ++i)
+				{
+					GA_Offset offset = off + i;
+					attr = handle.get(offset);
+					inputlist[i] = attr;
+				}
+				return true;
+			}
+			else
+			{
+				VRAYwarningOnce("Handle for attribute %s is not valid.", name.c_str());
+				return false;
+			}
+		}
+
+	};
+}
+
+#endif
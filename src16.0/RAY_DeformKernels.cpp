@@ -0,0 +1,417 @@
+#include "RAY_DeformKernels.h"
+
+using namespace HDK_Deform;
+
+namespace
+{
+	/// parameters
+
+	typedef std::unordered_map<std::string, std::string> KernelParms;
+
+	fpreal32 parmFloat(const KernelParms& parms, const char* name, fpreal32 def)
+	{
+		auto it = parms.find(name);
+		return it == parms.end() ? def : (fpreal32)atof(it->second.c_str());
+	}
+
+	UT_Vector3 parmVector(const KernelParms& parms, const char* name, const UT_Vector3& def)
+	{
+		auto it = parms.find(name);
+		if (it == parms.end()) { return def; }
+		UT_Vector3 v(def);
+		if (sscanf(it->second.c_str(), "%f,%f,%f", &v.x(), &v.y(), &v.z()) == 1) { v.y() = v.z() = v.x(); }
+		return v;
+	}
+
+	/// kernels
+
+	class TransformKernel : public RAY_DeformKernel
+	{
+	public:
+		TransformKernel(const KernelParms& parms)
+		{
+			UT_Vector3 t = parmVector(parms, "t", UT_Vector3(0, 0, 0));
+			UT_Vector3 r = parmVector(parms, "r", UT_Vector3(0, 0, 0));
+			UT_Vector3 s = parmVector(parms, "s", UT_Vector3(1, 1, 1));
+			// scale, rotate xyz, translate
+			UT_Matrix4 m(1.0f);
+			m.scale(s.x(), s.y(), s.z());
+			m.rotate(UT_Axis3::XAXIS, SYSdegToRad(r.x()));
+			m.rotate(UT_Axis3::YAXIS, SYSdegToRad(r.y()));
+			m.rotate(UT_Axis3::ZAXIS, SYSdegToRad(r.z()));
+			m.translate(t.x(), t.y(), t.z());
+			for (int i = 0; i < 4; ++i)
+			{
+				for (int j = 0; j < 3; ++j) { mat[i][j] = v4uf(m(i, j)); }
+			}
+		}
+
+	protected:
+		virtual void deformBlock(RAY_DeformLanes& p, const RAY_DeformLanes* n, int count) const
+		{
+			for (int i = 0; i < RAY_DeformLanes::laneCount(count); i += 4)
+			{
+				v4uf x(p.x + i), y(p.y + i), z(p.z + i);
+				// row vector times matrix
+				(x * mat[0][0] + y * mat[1][0] + z * mat[2][0] + mat[3][0]).store(p.x + i);
+				(x * mat[0][1] + y * mat[1][1] + z * mat[2][1] + mat[3][1]).store(p.y + i);
+				(x * mat[0][2] + y * mat[1][2] + z * mat[2][2] + mat[3][2]).store(p.z + i);
+			}
+		}
+
+	private:
+		v4uf mat[4][3];
+	};
+
+	// deformers parameterized along an axis: t in [0, 1] over the capture length
+	class AxisKernel : public RAY_DeformKernel
+	{
+	public:
+		AxisKernel(const KernelParms& parms)
+		{
+			axis = SYSclamp((int)parmFloat(parms, "axis", 1), 0, 2);
+			origin = parmVector(parms, "origin", UT_Vector3(0, 0, 0));
+			length = parmFloat(parms, "length", 1.0f);
+			if (length <= 0.0f) { length = 1.0f; }
+		}
+
+	protected:
+		virtual void deformBlock(RAY_DeformLanes& p, const RAY_DeformLanes* n, int count) const
+		{
+			fpreal32* pu = p.axis(axis);
+			fpreal32* pb = p.axis((axis + 1) % 3);
+			fpreal32* pc = p.axis((axis + 2) % 3);
+			const v4uf ou(origin(axis)), ob(origin((axis + 1) % 3)), oc(origin((axis + 2) % 3));
+			const v4uf inv_length(1.0f / length);
+			for (int i = 0; i < RAY_DeformLanes::laneCount(count); i += 4)
+			{
+				// local coordinates relative to the origin
+				v4uf u = v4uf(pu + i) - ou;
+				v4uf vb = v4uf(pb + i) - ob;
+				v4uf vc = v4uf(pc + i) - oc;
+				v4uf t = u * inv_length;
+				deformLanes(u, vb, vc, t);
+				(u + ou).store(pu + i);
+				(vb + ob).store(pb + i);
+				(vc + oc).store(pc + i);
+			}
+		}
+		// u along the axis, vb/vc across it
+		virtual void deformLanes(v4uf& u, v4uf& vb, v4uf& vc, const v4uf& t) const = 0;
+
+		// cosine and sine of angle * t clamped to [0, 1]: VM_SIMD has no trig, evaluated per lane
+		static void sinCosLanes(fpreal32 angle, const v4uf& t, v4uf& c, v4uf& s)
+		{
+			SYS_ALIGN16 fpreal32 tl[4], cl[4], sl[4];
+			vmin(vmax(t, v4uf(0.0f)), v4uf(1.0f)).store(tl);
+			for (int l = 0; l < 4; ++l)
+			{
+				cl[l] = SYScos(angle * tl[l]);
+				sl[l] = SYSsin(angle * tl[l]);
+			}
+			c = v4uf(cl);
+			s = v4uf(sl);
+		}
+
+		int axis;
+		UT_Vector3 origin;
+		fpreal32 length;
+	};
+
+	class TwistKernel : public AxisKernel
+	{
+	public:
+		TwistKernel(const KernelParms& parms) : AxisKernel(parms)
+		{
+			angle = SYSdegToRad(parmFloat(parms, "angle", 0.0f));
+		}
+
+	protected:
+		virtual void deformLanes(v4uf& u, v4uf& vb, v4uf& vc, const v4uf& t) const
+		{
+			// rotation across the axis grows with t
+			v4uf c, s;
+			sinCosLanes(angle, t, c, s);
+			v4uf nb = vb * c - vc * s;
+			v4uf nc = vb * s + vc * c;
+			vb = nb;
+			vc = nc;
+		}
+
+	private:
+		fpreal32 angle;
+	};
+
+	class TaperKernel : public AxisKernel
+	{
+	public:
+		TaperKernel(const KernelParms& parms) : AxisKernel(parms)
+		{
+			scale = parmFloat(parms, "scale", 1.0f);
+		}
+
+	protected:
+		virtual void deformLanes(v4uf& u, v4uf& vb, v4uf& vc, const v4uf& t) const
+		{
+			// cross-section scale from 1 at the origin to scale at the end of the length
+			v4uf tc = vmin(vmax(t, v4uf(0.0f)), v4uf(1.0f));
+			v4uf f = v4uf(1.0f) + tc * v4uf(scale - 1.0f);
+			vb = vb * f;
+			vc = vc * f;
+		}
+
+	private:
+		fpreal32 scale;
+	};
+
+	class BendKernel : public AxisKernel
+	{
+	public:
+		BendKernel(const KernelParms& parms) : AxisKernel(parms)
+		{
+			angle = SYSdegToRad(parmFloat(parms, "angle", 0.0f));
+		}
+
+	protected:
+		virtual void deformLanes(v4uf& u, v4uf& vb, v4uf& vc, const v4uf& t) const
+		{
+			if (SYSequalZero(angle)) { return; }
+			// the capture length is rolled onto an arc of radius length/angle towards the next axis,
+			// points past its end continue along the end tangent
+			const v4uf radius(length / angle);
+			v4uf tc = vmin(vmax(t, v4uf(0.0f)), v4uf(1.0f));
+			v4uf extra = (t - tc) * v4uf(length);
+			v4uf c, s;
+			sinCosLanes(angle, t, c, s);
+			v4uf r = radius - vb;
+			u = r * s + extra * c;
+			vb = radius - r * c + extra * s;
+		}
+
+	private:
+		fpreal32 angle;
+	};
+
+	class NoiseKernel : public RAY_DeformKernel
+	{
+	public:
+		NoiseKernel(const KernelParms& parms)
+		{
+			amp = parmFloat(parms, "amp", 0.1f);
+			freq = parmVector(parms, "freq", UT_Vector3(1, 1, 1));
+			offset = parmVector(parms, "offset", UT_Vector3(0, 0, 0));
+		}
+
+	protected:
+		virtual bool needsNormal() const { return true; }
+		virtual void deformBlock(RAY_DeformLanes& p, const RAY_DeformLanes* n, int count) const
+		{
+			// hashed lattice values per lane into the scratch lanes, displacement along N in lanes
+			fpreal32* nv = p.w;
+			for (int i = 0; i < count; ++i)
+			{
+				nv[i] = valueNoise(p.x[i] * freq.x() + offset.x(), p.y[i] * freq.y() + offset.y(), p.z[i] * freq.z() + offset.z());
+			}
+			for (int i = count; i < RAY_DeformLanes::laneCount(count); ++i) { nv[i] = 0.0f; }
+			const v4uf ampv(amp);
+			for (int i = 0; i < RAY_DeformLanes::laneCount(count); i += 4)
+			{
+				v4uf d = v4uf(nv + i) * ampv;
+				(v4uf(p.x + i) + v4uf(n->x + i) * d).store(p.x + i);
+				(v4uf(p.y + i) + v4uf(n->y + i) * d).store(p.y + i);
+				(v4uf(p.z + i) + v4uf(n->z + i) * d).store(p.z + i);
+			}
+		}
+
+	private:
+		// lattice value hash in [-1, 1]
+		static fpreal32 hashLattice(int x, int y, int z)
+		{
+			uint32 h = (uint32)x * 0x8da6b343u ^ (uint32)y * 0xd8163841u ^ (uint32)z * 0xcb1ab31fu;
+			h ^= h >> 13;
+			h *= 0x5bd1e995u;
+			h ^= h >> 15;
+			return (fpreal32)(h & 0xffffff) / (fpreal32)0x7fffff - 1.0f;
+		}
+		// smooth value noise in [-1, 1]
+		static fpreal32 valueNoise(fpreal32 x, fpreal32 y, fpreal32 z)
+		{
+			int ix = (int)SYSfloor(x), iy = (int)SYSfloor(y), iz = (int)SYSfloor(z);
+			fpreal32 fx = x - ix, fy = y - iy, fz = z - iz;
+			fx = fx * fx * (3.0f - 2.0f * fx);
+			fy = fy * fy * (3.0f - 2.0f * fy);
+			fz = fz * fz * (3.0f - 2.0f * fz);
+			fpreal32 c[2][2];
+			for (int dz = 0; dz < 2; ++dz)
+			{
+				for (int dy = 0; dy < 2; ++dy)
+				{
+					c[dz][dy] = SYSlerp(hashLattice(ix, iy + dy, iz + dz), hashLattice(ix + 1, iy + dy, iz + dz), fx);
+				}
+			}
+			return SYSlerp(SYSlerp(c[0][0], c[0][1], fy), SYSlerp(c[1][0], c[1][1], fy), fz);
+		}
+
+		fpreal32 amp;
+		UT_Vector3 freq;
+		UT_Vector3 offset;
+	};
+
+	class LatticeKernel : public RAY_DeformKernel
+	{
+	public:
+		LatticeKernel(const KernelParms& parms) : valid(false)
+		{
+			UT_Vector3 d = parmVector(parms, "divs", UT_Vector3(2, 2, 2));
+			for (int i = 0; i < 3; ++i) { divs[i] = SYSmax((int)d(i), 2); }
+			bmin = parmVector(parms, "min", UT_Vector3(-1, -1, -1));
+			bmax = parmVector(parms, "max", UT_Vector3(1, 1, 1));
+			auto it = parms.find("file");
+			if (it == parms.end()) { return; }
+
+			/// displacement of every lattice point from its rest position, x fastest
+			GU_Detail lattice;
+			if (!lattice.load(it->second.c_str(), 0).success() ||
+				lattice.getNumPoints() != (GA_Size)divs[0] * divs[1] * divs[2])
+			{
+				VRAYerror("Native lattice: cannot load %d x %d x %d points from %s.", divs[0], divs[1], divs[2], it->second.c_str());
+				return;
+			}
+			GA_ROHandleV3 p_h(lattice.getP());
+			displacement.resize(lattice.getNumPoints());
+			for (int k = 0; k < divs[2]; ++k)
+			{
+				for (int j = 0; j < divs[1]; ++j)
+				{
+					for (int i = 0; i < divs[0]; ++i)
+					{
+						int id = (k * divs[1] + j) * divs[0] + i;
+						UT_Vector3 rest(SYSlerp(bmin.x(), bmax.x(), (fpreal32)i / (divs[0] - 1)),
+							SYSlerp(bmin.y(), bmax.y(), (fpreal32)j / (divs[1] - 1)),
+							SYSlerp(bmin.z(), bmax.z(), (fpreal32)k / (divs[2] - 1)));
+						displacement[id] = p_h.get(lattice.pointOffset(GA_Index(id))) - rest;
+					}
+				}
+			}
+			valid = true;
+		}
+
+	protected:
+		virtual void deformBlock(RAY_DeformLanes& p, const RAY_DeformLanes* n, int count) const
+		{
+			if (!valid) { return; }
+			// cell lookups gather from the lattice: per point
+			UT_Vector3 size = bmax - bmin;
+			for (int i = 0; i < count; ++i)
+			{
+				UT_Vector3 pi(p.x[i], p.y[i], p.z[i]);
+				// points outside the lattice are not captured
+				UT_Vector3 cell;
+				bool inside = true;
+				for (int a = 0; a < 3; ++a)
+				{
+					fpreal32 t = size(a) > 0.0f ? (pi(a) - bmin(a)) / size(a) : 0.0f;
+					inside = inside && t >= 0.0f && t <= 1.0f;
+					cell(a) = t * (divs[a] - 1);
+				}
+				if (!inside) { continue; }
+				int c0[3];
+				fpreal32 f[3];
+				for (int a = 0; a < 3; ++a)
+				{
+					c0[a] = SYSmin((int)cell(a), divs[a] - 2);
+					f[a] = cell(a) - c0[a];
+				}
+				UT_Vector3 d(0, 0, 0);
+				for (int corner = 0; corner < 8; ++corner)
+				{
+					int di = corner & 1, dj = (corner >> 1) & 1, dk = (corner >> 2) & 1;
+					fpreal32 w = (di ? f[0] : 1.0f - f[0]) * (dj ? f[1] : 1.0f - f[1]) * (dk ? f[2] : 1.0f - f[2]);
+					d += displacement[((c0[2] + dk) * divs[1] + c0[1] + dj) * divs[0] + c0[0] + di] * w;
+				}
+				p.x[i] += d.x();
+				p.y[i] += d.y();
+				p.z[i] += d.z();
+			}
+		}
+
+	private:
+		bool valid;
+		int divs[3];
+		UT_Vector3 bmin;
+		UT_Vector3 bmax;
+		std::vector<UT_Vector3> displacement;
+	};
+}
+
+bool RAY_DeformKernel::isNative(const UT_StringHolder& cmd)
+{
+	return strncmp(cmd.c_str(), NATIVE_KERNEL_PREFIX, strlen(NATIVE_KERNEL_PREFIX)) == 0;
+}
+
+std::shared_ptr<RAY_DeformKernel> RAY_DeformKernel::create(const UT_StringHolder& cmd)
+{
+	if (!isNative(cmd)) { return nullptr; }
+	UT_String str(UT_String::ALWAYS_DEEP, cmd.c_str() + strlen(NATIVE_KERNEL_PREFIX));
+	char* argv[4096];
+	int argc = str.parse(argv, 4096);
+	if (argc < 1) { return nullptr; }
+
+	KernelParms parms;
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* eq = strchr(argv[i], '=');
+		if (eq) { parms[std::string(argv[i], eq - argv[i])] = std::string(eq + 1); }
+	}
+
+	std::string name(argv[0]);
+	if (name == "transform")	{ return std::make_shared<TransformKernel>(parms); }
+	if (name == "bend")			{ return std::make_shared<BendKernel>(parms); }
+	if (name == "twist")		{ return std::make_shared<TwistKernel>(parms); }
+	if (name == "taper")		{ return std::make_shared<TaperKernel>(parms); }
+	if (name == "noise")		{ return std::make_shared<NoiseKernel>(parms); }
+	if (name == "lattice")		{ return std::make_shared<LatticeKernel>(parms); }
+	VRAYerror("Unknown native kernel: %s", argv[0]);
+	return nullptr;
+}
+
+void RAY_DeformKernel::run(GU_Detail *gd, const GA_Range& range) const
+{
+	const GA_Attribute* nattrib = nullptr;
+	if (needsNormal())
+	{
+		nattrib = gd->findPointAttribute("N");
+		if (!nattrib || nattrib->getTupleSize() < 3)
+		{
+			VRAYwarningOnce("Native kernel: point N is needed, stage skipped.");
+			return;
+		}
+	}
+	GA_Attribute* pattrib = gd->getP();
+	// P may share pages with the base or a cached asset state, hardening isn't thread-safe
+	pattrib->hardenAllPages();
+	UTparallelFor(GA_SplittableRange(range), [&](const GA_SplittableRange& r)
+	{
+		GA_RWPageHandleV3 p_ph(pattrib);
+		GA_ROPageHandleV3 n_ph(nattrib);
+		// one page of soa lanes per task, heap: too large for worker stacks
+		std::unique_ptr<RAY_DeformLanes> p_lanes(new RAY_DeformLanes);
+		std::unique_ptr<RAY_DeformLanes> n_lanes(nattrib ? new RAY_DeformLanes : nullptr);
+		GA_Offset start, end;
+		// blockAdvance never crosses a page: each block is contiguous in the page handles
+		for (GA_Iterator it(r); it.blockAdvance(start, end); )
+		{
+			int count = (int)(end - start);
+			p_ph.setPage(start);
+			p_lanes->load(&p_ph.value(start), count);
+			if (nattrib)
+			{
+				n_ph.setPage(start);
+				n_lanes->load(&n_ph.value(start), count);
+			}
+			deformBlock(*p_lanes, n_lanes.get(), count);
+			p_lanes->store(&p_ph.value(start), count);
+		}
+	});
+	gd->getP()->bumpDataId();
+}
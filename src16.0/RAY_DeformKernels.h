@@ -0,0 +1,65 @@
+#ifndef __RAY_DeformKernels__
+#define __RAY_DeformKernels__
+
+#include "RAY_Deformer.h"
+
+#define NATIVE_KERNEL_PREFIX "native:"
+
+namespace HDK_Deform
+{
+	// a page of points transposed to x, y, z arrays, deformed 4 lanes per v4uf
+	// counts are padded to whole lanes, padding is computed and never written back
+	struct RAY_DeformLanes
+	{
+		SYS_ALIGN16 fpreal32 x[GA_PAGE_SIZE];
+		SYS_ALIGN16 fpreal32 y[GA_PAGE_SIZE];
+		SYS_ALIGN16 fpreal32 z[GA_PAGE_SIZE];
+		SYS_ALIGN16 fpreal32 w[GA_PAGE_SIZE];	// per lane scratch of a kernel, not loaded or stored
+
+		static int laneCount(int count) { return (count + 3) & ~3; }
+		void load(const UT_Vector3* p, int count)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				x[i] = p[i].x();
+				y[i] = p[i].y();
+				z[i] = p[i].z();
+			}
+			for (int i = count; i < laneCount(count); ++i) { x[i] = y[i] = z[i] = 0.0f; }
+		}
+		void store(UT_Vector3* p, int count) const
+		{
+			for (int i = 0; i < count; ++i) { p[i].assign(x[i], y[i], z[i]); }
+		}
+		fpreal32* axis(int a) { return a == 0 ? x : (a == 1 ? y : z); }
+	};
+
+	// built-in point deformer run straight over P pages on the worker pool, no cvex marshalling
+	// math runs on soa lanes; trig, noise hashing and lattice lookups are evaluated per lane
+	// selected by a cvex stage string "native:<kernel> key=value ...", vector values as x,y,z
+	//   transform	t= r= (degrees) s=
+	//   bend		axis= origin= length= angle=
+	//   twist		axis= origin= length= angle=
+	//   taper		axis= origin= length= scale=
+	//   noise		amp= freq= offset=			displacement along N
+	//   lattice	file= divs= min= max=		trilinear free-form deform, file holds the deformed lattice points
+	class RAY_DeformKernel
+	{
+	public:
+		virtual ~RAY_DeformKernel() {}
+
+		static bool isNative(const UT_StringHolder& cmd);
+		// kernel of a stage string, nullptr if not native or not valid
+		static std::shared_ptr<RAY_DeformKernel> create(const UT_StringHolder& cmd);
+
+		// deform the points of range in gd, safe to call concurrently on different details
+		void run(GU_Detail *gd, const GA_Range& range) const;
+
+	protected:
+		// deform count points of a page, n is nullptr unless the kernel needs normals
+		virtual void deformBlock(RAY_DeformLanes& p, const RAY_DeformLanes* n, int count) const = 0;
+		virtual bool needsNormal() const { return false; }
+	};
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include "RAY_DeformLoader.h"
+#include "RAY_DeformCache.h"
+
+using namespace HDK_Deform;
+
+RAY_DeformLoader::RAY_DeformLoader(const std::vector<UT_StringHolder>& files, const RAY_AttribFilter* filter, int depth, int64 byte_budget, int io_threads) :
+	files(files), 
+	attrib_filter(filter), 
+	prefetch_depth(SYSmax(depth, 1)), 
+	prefetch_bytes(byte_budget), 
+	slots(files.size()), 
+	next_load(0), 
+	queued_num(0), 
+	queued_bytes(0), 
+	is_stop(false), 
+	wait_time(0.0), 
+	peak_bytes(0)
+{
+	int thread_num = SYSclamp(io_threads, 1, SYSmax((int)files.size(), 1));
+	for (int i = 0; i < thread_num; ++i)
+	{
+		io_pool.emplace_back(&RAY_DeformLoader::ioLoop, this);
+	}
+}
+
+RAY_DeformLoader::~RAY_DeformLoader()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		is_stop = true;
+	}
+	space_cond.notify_all();
+	for (auto& t : io_pool) { t.join(); }
+	// details never acquired
+	for (auto& slot : slots) { delete slot.gd; }
+}
+
+void RAY_DeformLoader::ioLoop()
+{
+	while (true)
+	{
+		int index;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			// always let one file through, a single asset may exceed the budget
+			space_cond.wait(guard, [this]()
+			{
+				return is_stop || (queued_num < prefetch_depth && (queued_num == 0 || queued_bytes < prefetch_bytes));
+			});
+			if (is_stop || next_load >= (int)files.size()) { return; }
+			index = next_load++;
+			// reserve the queue entry before reading, concurrent io threads respect the depth
+			queued_num++;
+		}
+
+		/// read and decompress outside the lock
+		GU_Detail* gd = new GU_Detail();
+		if (!RAY_DeformCache::load(gd, files[index], attrib_filter))
+		{
+			delete gd;
+			gd = nullptr;
+		}
+		int64 bytes = gd ? gd->getMemoryUsage(true) : 0;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			LoadSlot& slot = slots[index];
+			slot.gd = gd;
+			slot.bytes = bytes;
+			slot.ready = true;
+			queued_bytes += bytes;
+			peak_bytes = SYSmax(peak_bytes, queued_bytes);
+		}
+		loaded_cond.notify_all();
+	}
+}
+
+GU_Detail* RAY_DeformLoader::acquire(int index)
+{
+	UT_StopWatch timer;
+	timer.start();
+	std::unique_lock<std::mutex> guard(lock);
+	LoadSlot& slot = slots[index];
+	loaded_cond.wait(guard, [&slot]() { return slot.ready; });
+	wait_time += timer.lap();
+
+	GU_Detail* gd = slot.gd;
+	slot.gd = nullptr;
+	queued_num--;
+	queued_bytes -= slot.bytes;
+	guard.unlock();
+	space_cond.notify_all();
+	return gd;
+}
@@ -0,0 +1,60 @@
+#ifndef __RAY_DeformLoader__
+#define __RAY_DeformLoader__
+
+#include "RAY_Deformer.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace HDK_Deform
+{
+	// prefetching geometry loader: io threads read upcoming instance files ahead of the deform workers
+	// loaded but not yet acquired geometry is bounded by a count and a byte budget
+	class RAY_DeformLoader
+	{
+	public:
+		// filter, when given, is applied on the io threads and must outlive the loader
+		RAY_DeformLoader(const std::vector<UT_StringHolder>& files, const RAY_AttribFilter* filter, int depth, int64 byte_budget, int io_threads);
+		~RAY_DeformLoader();
+
+		// wait for file index to be loaded, caller takes the detail; nullptr if the load failed
+		// indices must be acquired in increasing order (one ticket per worker)
+		// blocks on io: call from a plain thread, never from a scheduler task
+		GU_Detail* acquire(int index);
+
+		fpreal64 waitTime() const { return wait_time; }
+		int64 peakBytes() const { return peak_bytes; }
+
+	private:
+		struct LoadSlot
+		{
+			GU_Detail* gd = nullptr;
+			int64 bytes = 0;
+			bool ready = false;
+		};
+
+		void ioLoop();
+
+		const std::vector<UT_StringHolder>& files;
+		const RAY_AttribFilter* attrib_filter;
+		int prefetch_depth;
+		int64 prefetch_bytes;
+		std::vector<LoadSlot> slots;
+		std::vector<std::thread> io_pool;
+
+		std::mutex lock;
+		std::condition_variable loaded_cond;	// a slot became ready
+		std::condition_variable space_cond;		// a slot was acquired, queue has room
+		int next_load;
+		int queued_num;		// loaded, not acquired
+		int64 queued_bytes;
+		bool is_stop;
+
+		fpreal64 wait_time;	// deform workers blocked on io
+		int64 peak_bytes;
+	};
+}
+
+#endif
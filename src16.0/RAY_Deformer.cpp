@@ -1,653 +1,2124 @@
-
-#include "RAY_Deformer.h"
-
-using namespace HDK_Deform;
-
-
-//** child procedural: deformer for single instance
-
-RAY_Deform::RAY_Deform(UT_Vector3 center, UT_StringHolder infile,
-	std::vector<UT_StringHolder>& cfiles, CVEXExtraAttribMap& cextra,
-	std::vector<int>& cruntypes, int cvexn, int isMultiT, int ins,
-	int compN, int isVB, int geoTSample, fpreal open, fpreal close, fpreal fps,
-	int* polyframeflags, const GU_PolyFrameParms& pf_parms):
-
-	isSuccess(true), 
-	center_pos(center), 
-	inputfile(infile), 
-	cvexfiles(cfiles), 
-	cvex_extraAttribs(cextra), 
-	cvex_runtypes(cruntypes), 
-	instance_id(ins), 
-	cvex_num(cvexn), 
-	is_multi_threads(isMultiT), 
-	is_compute_normal(compN), 
-	is_velBlur(isVB), 
-	geo_timeSample(geoTSample), 
-	camShutter_open(open),
-	camShutter_close(close), 
-	fps(fps), 
-	polyframe_flags(polyframeflags),
-	polyframe_parms(pf_parms)
-{
-	bbox.initBounds(0.0, 0.0, 0.0);
-	if (preprocess() == 0) { isSuccess = false; }	// calculate bbox during child construction
-}
-
-RAY_Deform::~RAY_Deform()
-{
-	cleanBuffer();
-}
-
-const char* RAY_Deform::className() const
-{
-	return "RAY_Deform";
-}
-
-// child procedural: this function never be called
-int RAY_Deform::initialize(const UT_BoundingBox *box)
-{
-	return 0;
-}
-
-void RAY_Deform::getBoundingBox(UT_BoundingBox &box)
-{
-	box.enlargeBounds(bbox);
-	// box = bbox;
-}
-
-void RAY_Deform::render()
-{
-	if (!isSuccess) { return; }
-
-	/// motion blur
-	// velocity motion blur: can only run in render() somehow...
-	if (is_velBlur)
-	{
-		/// motion blur
-		fpreal preBlur = -(camShutter_open) / fps;
-		fpreal postBlur = (camShutter_close) / fps;
-		geo.addVelocityBlur(preBlur, postBlur);
-	}
-
-	VRAY_ProceduralChildPtr obj = createChild();
-	obj->addGeometry(geo);
-}
-
-/// preprocess
-
-int RAY_Deform::preprocess()
-{
-	/// load geo from file
-	if (!loadGeo()) { return 0; }
-	GU_Detail* gd = geo.get();
-
-	std::vector<GU_Detail*> gdlist;
-	std::vector<fpreal32> shutterlist;
-	gdlist.push_back(gd);
-	shutterlist.push_back((fpreal32)camShutter_open);		// default shutter time for no motion blur is 0.0
-
-	/// motion blur
-	if (!is_velBlur)
-	{
-		fpreal shutter_time = camShutter_close - camShutter_open;
-		if (geo_timeSample > 0 && shutter_time > 0.0)
-		{
-			fpreal shutter_step;
-			if (geo_timeSample <= 1) { shutter_step = 0; }
-			else
-			{
-				shutter_step = shutter_time / (geo_timeSample - 1);
-			}
-			for (int i = 1; i < geo_timeSample; ++i)
-			{
-				fpreal curr_shutter_norm = (i * shutter_step) / shutter_time;
-
-				auto g1 = geo.appendSegmentGeometry(curr_shutter_norm);	// pass normalized shutter (scale from 0 to 1)
-				GU_DetailHandleAutoWriteLock wlock(g1);
-				if (!wlock.getGdp()->load(inputfile, 0).success())
-				{
-					VRAYerror("Unable to load motion blur segment geometry[%d]: %s", i, inputfile.c_str());
-					geo.removeSegmentGeometry(g1);
-				}
-				else
-				{
-					shutterlist.push_back((fpreal32)(camShutter_open + i * shutter_step));
-					gdlist.push_back(wlock.getGdp());
-				}
-			}
-		}
-	}
-
-    // fpreal32 current_shutter;
-	/// execute cvex on different shutter GU_Details
-	for (int guid = 0; guid < gdlist.size(); ++guid)
-	{
-		GU_Detail* current_gd = gdlist[guid];
-        fpreal32 *current_shutter = shutterlist.data() + guid;
-
-		// move to center
-		current_gd->translate(center_pos);
-
-		/// pre polyframe
-		if (polyframe_flags[0])	{ /*for (auto current_gd : gdlist)*/	{ polyFrame(current_gd);} }
-
-		/// execute different cvex files
-		for (int i = 0; i < cvexfiles.size(); ++i)
-		{
-			// RAYprintf(0, "=== Start execute cvex id: %d ===", i);
-			inputcvex = cvexfiles[i];
-			cvex_runtype = cvex_runtypes[i];
-
-			// execute cvex
-			if (cvex_runtype == DO_POINTS || cvex_runtype == DO_PRIMS || cvex_runtype == DO_VERTS || cvex_runtype == DO_DETAILS) 
-				{ executeCVEX(current_gd, current_shutter); }
-			else { VRAYprintf(0, "No valid cvex. Create geometry instance only."); }
-
-			// clean buffer for cvex
-			cleanBuffer();
-
-			// post polyframe after each cvex
-			if (polyframe_flags[i + 1]) { /*for (auto current_gd : gdlist)*/ { polyFrame(current_gd); } }
-		}
-	}
-
-	/// update bbox
-	gd->getBBox(&bbox);
-	if (is_velBlur)
-	{
-		// update bbox based on "v" attribute
-		velBBox(gd, bbox);
-	}
-	else
-	{
-		// add bbox from segment geo
-		for (int guid = 1; guid < gdlist.size(); ++guid)
-		{
-			UT_BoundingBox segmentBBox;
-			GU_Detail* current_gd = gdlist[guid];
-			current_gd->getBBox(&segmentBBox);
-			bbox.enlargeBounds(segmentBBox);
-		}
-	}
-
-	/// re-compute normal
-	if (is_compute_normal)
-	{
-		// gd->normal();
-		for (auto current_gd : gdlist)
-		{
-			current_gd->normal();
-		}
-	}
-
-	return 1;
-}
-
-void RAY_Deform::cleanBuffer()
-{
-	// delete inputs
-	for (auto buffer : inputbuffer)
-	{
-		for (auto pt : buffer)
-		{
-			delete[] pt;
-		}
-		buffer.clear();
-	}
-	inputbuffer.clear();
-	// delete outputs
-	for (auto buffer : vec3_outputbuffer)
-	{
-		for (const auto& attribinfo : buffer)
-		{
-			delete[] attribinfo.second;
-		}
-		buffer.clear();
-	}
-	for (auto buffer : float_outputbuffer)
-	{
-		for (const auto& attribinfo : buffer)
-		{
-			delete[] attribinfo.second;
-		}
-		buffer.clear();
-	}
-	for (auto buffer : vec4_outputbuffer)
-	{
-		for (const auto& attribinfo : buffer)
-		{
-			delete[] attribinfo.second;
-		}
-		buffer.clear();
-	}
-	for (auto buffer : int_outputbuffer)
-	{
-		for (const auto& attribinfo : buffer)
-		{
-			delete[] attribinfo.second;
-		}
-		buffer.clear();
-	}
-	vec3_outputbuffer.clear();
-	float_outputbuffer.clear();
-	vec4_outputbuffer.clear();
-	int_outputbuffer.clear();
-	// delete attribute holder
-	geoattriblist.clear();
-	cvexoutputnamelist.clear();
-}
-
-/// Geo
-
-bool RAY_Deform::loadGeo()
-{
-	geo = createGeometry();
-	
-	// Load geometry from disk
-	if (!geo->load(inputfile, 0).success())
-	{
-		VRAYerror("Unable to load geometry[0]: %s", inputfile.c_str());
-		return false;
-	}
-	// RAYprintf(0, "Load geometry[0] success: %s", inputfile.c_str());
-	
-	return true;
-}
-
-/// bbox
-
-void RAY_Deform::velBBox(GU_Detail *gd, UT_BoundingBox& box)
-{
-	UT_BoundingBox testbox;
-	// traverse the geo and cal pos displacement based on "v" attribute
-	int size = gd->getNumPoints();
-	GA_AttributeOwner owner = GA_ATTRIB_POINT;
-	GA_Offset offset = gd->pointOffset(GA_Index(0));
-	UT_Vector3* vel_list = new UT_Vector3[size];
-	UT_Vector3* pos_list = new UT_Vector3[size];
-	if (getTypedAttribByGeom<UT_Vector3>(gd, "P", pos_list, owner, offset, size) &&
-		getTypedAttribByGeom<UT_Vector3>(gd, "v", vel_list, owner, offset, size))
-	{
-		fpreal preBlur = -(camShutter_open) / fps;
-		fpreal postBlur = (camShutter_close) / fps;
-		for (int i = 0; i < size; ++i)
-		{
-			UT_Vector3 prePos = pos_list[i] - vel_list[i] * preBlur;
-			UT_Vector3 postPos = pos_list[i] + vel_list[i] * postBlur;
-			box.enlargeBounds(prePos);
-			box.enlargeBounds(postPos);
-		}
-	}
-	delete[] vel_list;
-	delete[] pos_list;
-}
-
-/// PolyFrame
-
-void RAY_Deform::polyFrame(GU_Detail *gd)
-{
-	GU_PolyFrame polyframe(gd);
-    GU_PolyFrameError err = polyframe.computeFrames(polyframe_parms);
-	switch (err)
-	{
-	case GU_POLYFRAME_CREATE_ATTRIBUTE_FAILED:
-		VRAYerror("PolyFrame create attribute failed.");
-		break;
-	case GU_POLYFRAME_MISSING_DETAIL:
-		VRAYerror("PolyFrame missing detail.");
-		break;
-	case GU_POLYFRAME_MISSING_TEXTURE_COORDS:
-		VRAYerror("PolyFrame missing texture coords.");
-		break;
-	default:
-		break;
-	}
-}
-
-
-/// CVEX
-
-void RAY_Deform::executeCVEX(GU_Detail *gd, fpreal32* shutter)
-{
-	int total_size;
-	// set cvex size
-	// cvextype: 0-points, 1-primitives, 2-vertices
-	switch (cvex_runtype)
-	{
-	case DO_POINTS:
-		total_size = gd->getNumPoints();
-		break;
-	case DO_PRIMS:
-		total_size = gd->getNumPrimitives();
-		break;
-	case DO_VERTS:
-		total_size = gd->getNumVertices();
-		break;
-	case DO_DETAILS:
-		total_size = 1;
-		break;
-	default:
-		break;
-	}
-	// RAYprintf(0, "CVEX size: %d", total_size);
-
-	int thread_num = total_size / CHUCK_SIZE;
-	if (total_size % CHUCK_SIZE != 0) { thread_num++; }
-
-	// set buffer for each threads
-	inputbuffer.resize(thread_num);
-	vec3_outputbuffer.resize(thread_num);
-	float_outputbuffer.resize(thread_num);
-	vec4_outputbuffer.resize(thread_num);
-	int_outputbuffer.resize(thread_num);
-
-	/// single thread
-	if (!is_multi_threads)
-	{
-		// init
-		CVEX_Context cvex;
-		CVEX_RunData rundata;
-		UT_Array<exint> procid(total_size, total_size);
-		rundata.setProcId(procid.array());
-		VEX_GeoCommandQueue geocmd;
-		geocmd.myNumPrim = gd->getNumPrimitives();
-		geocmd.myNumVertex = gd->getNumVertices();
-		geocmd.myNumPoint = gd->getNumPoints();
-		rundata.setGeoCommandQueue(&geocmd);
-		processCVEX(cvex, rundata, gd, 0, total_size, 0, shutter);
-		// gvex
-		GVEX_GeoCommand allcmd;
-		allcmd.appendQueue(geocmd);
-		allcmd.apply(gd);
-
-		return;
-	}
-
-	/// multi threads
-	// parse geom attributes
-	getGeomAttribs(gd);	// only run before multi-threads
-	CVEX_Context cvex;
-	// add cvex input
-	addCVEXInput(cvex);
-	// load cvex
-	if (!loadCVEX(cvex)) { return; }
-	// create new outputs based on cvex function and create corresponding attrib for geom
-	createGeomAttribFromCVEXOutput(cvex, gd);	// only run before multi-threads
-
-	VEX_GeoCommandQueue** threadcmds;
-	threadcmds = new VEX_GeoCommandQueue*[thread_num];
-	CVEXProcessData** procDataBuffer = new CVEXProcessData*[thread_num];
-
-	UT_PtrArray<UT_Thread*> threads;
-	void* data = nullptr;
-	for (int tid = 0; tid < thread_num; tid++)
-	{
-		procDataBuffer[tid] = new CVEXProcessData(this, gd, threadcmds, tid, total_size, thread_num, *shutter);
-		data = procDataBuffer[tid];
-		threads.append(UT_Thread::allocThread(UT_Thread::ThreadLowUsage));
-		if (!threads(tid) || !threads(tid)->startThread(&executeSingleCVEX, data))
-		{
-			VRAYerror("Failed to create thread %d", tid);
-			break;
-		}
-	}
-	// Wait for all threads to finish, deallocate them once done
-	for (int i = 0; i < threads.entries(); i++)
-	{
-		threads(i)->waitForState(UT_Thread::ThreadIdle);
-		delete threads(i);
-	}
-	// gvex
-	GVEX_GeoCommand allcmd;
-	for (int tid = 0; tid < thread_num; ++tid)
-	{
-		allcmd.appendQueue(*threadcmds[tid]);
-	}
-	allcmd.apply(gd);
-
-	// clean memory
-	for (int tid = 0; tid < thread_num; ++tid)
-	{
-		delete threadcmds[tid];
-		delete procDataBuffer[tid];
-	}
-	delete[] threadcmds;
-	delete[] procDataBuffer;
-}
-
-bool RAY_Deform::processCVEX(CVEX_Context &context, CVEX_RunData &rundata, GU_Detail *gd, int gid, int size, int tid, fpreal32* shutter)
-{
-	// parse geom attrib
-	getGeomAttribs(gd);
-	// add cvex input
-	addCVEXInput(context);
-	// load cvex
-	if (!loadCVEX(context)) { return false; }
-	// create new outputs based on cvex function and create corresponding attrib for geom
-	createGeomAttribFromCVEXOutput(context, gd);
-	// allocate memory for input and output
-	findCVEX(context, gd, gid, size, tid, shutter);
-
-	// run cvex program
-	context.run(size, true, &rundata);
-	// pass cvex result back to geom
-	setCVEXOutput(context, gd, gid, size, tid);
-
-	return true;
-}
-
-void RAY_Deform::getGeomAttribs(GU_Detail *gd)
-{
-	/// get geom attributes
-	// cvextype: 0-points, 1-primitives, 2-vertices
-	switch (cvex_runtype)
-	{
-		// points
-	case DO_POINTS:
-	{
-		for (GA_AttributeDict::iterator it = gd->pointAttribs().begin(); !it.atEnd(); ++it)
-		{
-			geoattriblist.push_back(it.attrib());
-		}
-		break;
-	}
-	// prims
-	case DO_PRIMS:
-	{
-		for (GA_AttributeDict::iterator it = gd->primitiveAttribs().begin(); !it.atEnd(); ++it)
-		{
-			geoattriblist.push_back(it.attrib());
-		}
-		break;
-	}
-	// verts
-	case DO_VERTS:
-	{
-		for (GA_AttributeDict::iterator it = gd->vertexAttribs().begin(); !it.atEnd(); ++it)
-		{
-			geoattriblist.push_back(it.attrib());
-		}
-		break;
-	}
-	case DO_DETAILS:
-	{
-		for (GA_AttributeDict::iterator it = gd->attribs().begin(); !it.atEnd(); ++it)
-		{
-			geoattriblist.push_back(it.attrib());
-		}
-		break;
-	}
-	default:
-		break;
-	}
-}
-
-void RAY_Deform::addCVEXInput(CVEX_Context &context)
-{
-	/// add instance and shutter as uniform input
-	context.addInput("instance", CVEX_TYPE_INTEGER, false);
-	context.addInput("shutter", CVEX_TYPE_FLOAT, false);
-
-	/// add extra uniform input
-	for (const auto & attribinfo : cvex_extraAttribs.floatAttribMap)
-	{
-		context.addInput(attribinfo.first, CVEX_TYPE_FLOAT, false);
-	}
-	for (const auto & attribinfo : cvex_extraAttribs.intAttribMap)
-	{
-		context.addInput(attribinfo.first, CVEX_TYPE_INTEGER, false);
-	}
-	for (const auto & attribinfo : cvex_extraAttribs.vec3AttribMap)
-	{
-		context.addInput(attribinfo.first, CVEX_TYPE_VECTOR3, false);
-	}
-	for (const auto & attribinfo : cvex_extraAttribs.vec4AttribMap)
-	{
-		context.addInput(attribinfo.first, CVEX_TYPE_VECTOR4, false);
-	}
-	/// add cvex inputs from geom attributes
-	for (auto attrib : geoattriblist)
-	{
-		CVEX_Type type = attrib2CVEXTypeHandler(attrib);
-		if (type != CVEX_TYPE_INVALID)
-		{
-			context.addInput(attrib->getName(), attrib2CVEXTypeHandler(attrib), true);
-		}
-	}
-}
-
-bool RAY_Deform::loadCVEX(CVEX_Context &context)
-{
-	// pass shoppath
-	UT_String shoppath = UT_String(inputcvex);
-
-	/// load cvex
-	char* argv[4096];
-	int argc = shoppath.parse(argv, 4096);
-	if (!context.load(argc, argv))	// Pass arguments to CVEX
-	{
-		VRAYerrorOnce("CVEX %s as runtype %d: Cannot load CVEX.", inputcvex.c_str(), cvex_runtype);
-		return false;
-	}
-	// VRAYprintf(0, "Load cvex success: %s", shoppath.c_str());
-	return true;
-}
-
-void RAY_Deform::findCVEX(CVEX_Context &context, GU_Detail *gd, int gid, int size, int tid, fpreal32* shutter)
-{
-	/// set instance input
-	findTypedUniformInput(context, "instance", &instance_id);
-	findTypedUniformInput(context, "shutter", shutter);
-
-	/// set extra uniform input
-	for (const auto & attribinfo : cvex_extraAttribs.floatAttribMap)
-	{
-		findTypedUniformInput(context, attribinfo.first, (fpreal32*)&(attribinfo.second));
-	}
-	for (const auto & attribinfo : cvex_extraAttribs.intAttribMap)
-	{
-		findTypedUniformInput(context, attribinfo.first, (int*)&(attribinfo.second));
-	}
-	for (const auto & attribinfo : cvex_extraAttribs.vec3AttribMap)
-	{
-		findTypedUniformInput(context, attribinfo.first, (UT_Vector3*)&(attribinfo.second));
-	}
-	for (const auto & attribinfo : cvex_extraAttribs.vec4AttribMap)
-	{
-		findTypedUniformInput(context, attribinfo.first, (UT_Vector4*)&(attribinfo.second));
-	}
-	/// set geom attrib inputs and outputs
-	findTypedCVEX(context, gd, vec3_outputbuffer, gid, size, tid);
-	findTypedCVEX(context, gd, float_outputbuffer, gid, size, tid);
-	findTypedCVEX(context, gd, vec4_outputbuffer, gid, size, tid);
-	findTypedCVEX(context, gd, int_outputbuffer, gid, size, tid);
-}
-
-void RAY_Deform::setCVEXOutput(CVEX_Context &context, GU_Detail *gd, int gid, int size, int tid)
-{
-	/// set geom attrib outputs back to geom
-	setTypedCVEXOutput(context, gd, vec3_outputbuffer, gid, size, tid);
-	setTypedCVEXOutput(context, gd, float_outputbuffer, gid, size, tid);
-	setTypedCVEXOutput(context, gd, vec4_outputbuffer, gid, size, tid);
-	setTypedCVEXOutput(context, gd, int_outputbuffer, gid, size, tid);
-}
-
-CVEX_Type RAY_Deform::attrib2CVEXTypeHandler(GA_Attribute* attrib)
-{
-	if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 3) { return CVEX_TYPE_FLOAT; }
-	if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 4) { return CVEX_TYPE_VECTOR3; }
-	if (attrib->getStorageClass() == GA_STORECLASS_FLOAT) { return CVEX_TYPE_VECTOR4; }
-	if (attrib->getStorageClass() == GA_STORECLASS_INT) { return CVEX_TYPE_INTEGER; }
-	return CVEX_TYPE_INVALID;
-}
-
-void RAY_Deform::createGeomAttribFromCVEXOutput(CVEX_Context &context, GU_Detail *gd)
-{
-	GA_AttributeOwner owner;
-	switch (cvex_runtype)
-	{
-	case DO_POINTS:
-	{
-		owner = GA_ATTRIB_POINT;
-		break;
-	}
-	case DO_PRIMS:
-	{
-		owner = GA_ATTRIB_PRIMITIVE;
-		break;
-	}
-	case DO_VERTS:
-	{
-		owner = GA_ATTRIB_VERTEX;
-		break;
-	}
-	case DO_DETAILS:
-	{
-		owner = GA_ATTRIB_DETAIL;
-		break;
-	}
-	default:
-		VRAYerrorOnce("CVEX %s as runtype %d: Cannot identify CVEX run type.", inputcvex.c_str(), cvex_runtype);
-	}
-
-	CVEX_ValueList& value_list = context.getOutputList();
-	CVEX_Value  *value;
-
-	for (int i = 0; i < value_list.entries(); ++i)
-	{
-		value = value_list.getValue(i);
-		// skip output value which is not exported
-		if (!value->isExport())	continue;
-		// create attribute for geom
-		UT_StringHolder name = value->getName();
-		// auto it = std::find_if(geoattriblist.begin(), geoattriblist.end(), [name](const auto& val) {return val->getName() == name; });   // C++14
-		auto it = std::find_if(geoattriblist.begin(), geoattriblist.end(), [name](const GA_Attribute* val) {return val->getName() == name; });
-		// not find the attribute
-		if (!(it != geoattriblist.end()))
-		{
-			int attrib_length = 1;
-			switch (value->getType())
-			{
-				case CVEX_TYPE_VECTOR3:
-				{
-					attrib_length = 3;
-					break;
-				}
-				case CVEX_TYPE_VECTOR4:
-				{
-					attrib_length = 4;
-					break;
-				}
-				default:	// float and int: length = 1
-				{
-					attrib_length = 1;
-					break;
-				}
-			}
-			gd->addFloatTuple(owner, GA_SCOPE_PUBLIC, value->getName(), attrib_length);
-		}
-		// set cvex output list
-		cvexoutputnamelist.push_back(name);
-	}
-}
+
+#include "RAY_Deformer.h"
+#include "RAY_DeformCache.h"
+#include "RAY_DeformKernels.h"
+
+using namespace HDK_Deform;
+
+namespace
+{
+	// parallel point bound reduction straight over P (and v) attribute pages
+	// pre/post blur positions are swept with SIMD min/max, no temporary arrays
+	class PointBoundReducer
+	{
+	public:
+		PointBoundReducer(const GA_Attribute* p, const GA_Attribute* v, fpreal32 preblur, fpreal32 postblur) :
+			myP(p), myV(v), myPreBlur(preblur), myPostBlur(postblur),
+			myMin(SYS_FP32_MAX), myMax(-SYS_FP32_MAX)
+		{}
+		PointBoundReducer(const PointBoundReducer& src, UT_Split) :
+			myP(src.myP), myV(src.myV), myPreBlur(src.myPreBlur), myPostBlur(src.myPostBlur),
+			myMin(SYS_FP32_MAX), myMax(-SYS_FP32_MAX)
+		{}
+
+		void operator()(const GA_SplittableRange& r)
+		{
+			GA_ROPageHandleV3 p_ph(myP);
+			GA_ROPageHandleV3 v_ph(myV);
+			const v4uf preblur(myPreBlur);
+			const v4uf postblur(myPostBlur);
+			v4uf bmin = myMin;
+			v4uf bmax = myMax;
+
+			GA_Offset start, end;
+			for (GA_Iterator it(r); it.blockAdvance(start, end); )
+			{
+				p_ph.setPage(start);
+				if (myV)
+				{
+					v_ph.setPage(start);
+					for (GA_Offset off = start; off < end; ++off)
+					{
+						const UT_Vector3& p = p_ph.value(off);
+						const UT_Vector3& v = v_ph.value(off);
+						v4uf pos(p.x(), p.y(), p.z(), 0.0f);
+						v4uf vel(v.x(), v.y(), v.z(), 0.0f);
+						v4uf prepos = pos - vel * preblur;
+						v4uf postpos = pos + vel * postblur;
+						bmin = vmin(bmin, vmin(prepos, postpos));
+						bmax = vmax(bmax, vmax(prepos, postpos));
+					}
+				}
+				else
+				{
+					for (GA_Offset off = start; off < end; ++off)
+					{
+						const UT_Vector3& p = p_ph.value(off);
+						v4uf pos(p.x(), p.y(), p.z(), 0.0f);
+						bmin = vmin(bmin, pos);
+						bmax = vmax(bmax, pos);
+					}
+				}
+			}
+			myMin = bmin;
+			myMax = bmax;
+		}
+
+		void join(const PointBoundReducer& other)
+		{
+			myMin = vmin(myMin, other.myMin);
+			myMax = vmax(myMax, other.myMax);
+		}
+
+		void enlarge(UT_BoundingBox& box) const
+		{
+			// nothing visited
+			if (myMin[0] > myMax[0]) { return; }
+			box.enlargeBounds(UT_Vector3(myMin[0], myMin[1], myMin[2]));
+			box.enlargeBounds(UT_Vector3(myMax[0], myMax[1], myMax[2]));
+		}
+
+	private:
+		const GA_Attribute* myP;
+		const GA_Attribute* myV;
+		fpreal32 myPreBlur;
+		fpreal32 myPostBlur;
+		v4uf myMin;
+		v4uf myMax;
+	};
+
+	// attribute owner of a cvex run type
+	GA_AttributeOwner runtypeOwner(int runtype)
+	{
+		switch (runtype)
+		{
+		case DO_POINTS:	return GA_ATTRIB_POINT;
+		case DO_PRIMS:	return GA_ATTRIB_PRIMITIVE;
+		case DO_VERTS:	return GA_ATTRIB_VERTEX;
+		default:		return GA_ATTRIB_DETAIL;
+		}
+	}
+
+	// all elements of a cvex run type
+	GA_Range elementRange(int runtype, const GU_Detail *gd)
+	{
+		switch (runtype)
+		{
+		case DO_POINTS:	return gd->getPointRange();
+		case DO_PRIMS:	return gd->getPrimitiveRange();
+		case DO_VERTS:	return gd->getVertexRange();
+		default:		return GA_Range();
+		}
+	}
+
+	// contiguous offset blocks of a range, blockAdvance never crosses a GA page
+	void collectBlocks(const GA_Range& range, std::vector<CVEXBlock>& blocks)
+	{
+		GA_Offset start, end;
+		for (GA_Iterator it(range); it.blockAdvance(start, end); ) { blocks.push_back(CVEXBlock(start, (int)(end - start))); }
+	}
+
+	// page-aligned chunk size for the remaining elements of a stage, from the timing of its first chunk:
+	// large enough that per-chunk setup stays under 1/CVEX_SETUP_RATIO of the chunk,
+	// small enough that each worker gets CVEX_CHUNKS_PER_WORKER chunks for load balance
+	int adaptiveChunkSize(int remaining, int measured_size, fpreal64 setup_time, fpreal64 run_time)
+	{
+		exint workers = SYSmax(UT_Thread::getNumProcessors(), 1);
+		exint per_worker = (remaining + workers - 1) / workers;
+		exint balanced = remaining / (workers * CVEX_CHUNKS_PER_WORKER);
+		exint amortized = per_worker;
+		fpreal64 elem_cost = run_time / SYSmax(measured_size, 1);
+		if (elem_cost > 0.0)
+		{
+			amortized = (exint)SYSmin(CVEX_SETUP_RATIO * setup_time / elem_cost, (fpreal64)per_worker);
+		}
+		exint size = SYSmin(SYSmax(amortized, balanced), per_worker);
+		// round up to whole pages so neighbouring chunks never write the same attribute page
+		size = ((size + GA_PAGE_SIZE - 1) / GA_PAGE_SIZE) * GA_PAGE_SIZE;
+		return (int)SYSmax(size, (exint)GA_PAGE_SIZE);
+	}
+
+	// true when the bound of the points is a valid bound of all primitives (polygonal geometry)
+	bool isPointBounded(const GU_Detail *gd)
+	{
+		GA_Size polycount = gd->countPrimitiveType(GA_PRIMPOLY) + 
+			gd->countPrimitiveType(GA_PRIMPOLYSOUP) + 
+			gd->countPrimitiveType(GA_PRIMMESH);
+		return polycount == gd->getNumPrimitives();
+	}
+
+	// point to primitive adjacency by offset, counted and filled in parallel over the point-vertex links
+	void buildAdjacency(const GU_Detail *gd, std::vector<GA_Size>& adj_start, std::vector<GA_Offset>& adj_prims)
+	{
+		GA_Size point_num = gd->getNumPointOffsets();
+		adj_start.assign(point_num + 1, 0);
+		UTparallelFor(GA_SplittableRange(gd->getPointRange()), [&](const GA_SplittableRange& r)
+		{
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				GA_Size count = 0;
+				for (GA_Offset vtx = gd->pointVertex(*it); GAisValid(vtx); vtx = gd->vertexToNextVertex(vtx)) { ++count; }
+				adj_start[*it + 1] = count;
+			}
+		});
+		for (GA_Size pt = 0; pt < point_num; ++pt) { adj_start[pt + 1] += adj_start[pt]; }
+		adj_prims.resize(adj_start[point_num]);
+		UTparallelFor(GA_SplittableRange(gd->getPointRange()), [&](const GA_SplittableRange& r)
+		{
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				GA_Size a = adj_start[*it];
+				for (GA_Offset vtx = gd->pointVertex(*it); GAisValid(vtx); vtx = gd->vertexToNextVertex(vtx)) { adj_prims[a++] = gd->vertexPrimitive(vtx); }
+			}
+		});
+	}
+
+	// point normals of the points that moved since the sourceP snapshot and of their one-ring neighbours
+	// GU_Detail::normal() over the primitives around them, so the weighting is the full recompute's
+	// the other points keep N: none of their primitives changed
+	void dirtyNormals(GU_Detail *gd, const GA_Attribute* sourceP, const std::vector<GA_Size>& adj_start, const std::vector<GA_Offset>& adj_prims)
+	{
+		GA_Size point_num = (GA_Size)adj_start.size() - 1;
+		GA_Size prim_num = gd->getNumPrimitiveOffsets();
+		std::vector<char> moved_points(point_num, 0);
+		std::vector<char> update_points(point_num, 0);
+		std::vector<char> update_prims(prim_num, 0);
+
+		/// moved points
+		UTparallelFor(GA_SplittableRange(gd->getPointRange()), [&](const GA_SplittableRange& r)
+		{
+			GA_ROHandleV3 p_h(gd->getP());
+			GA_ROHandleV3 source_h(sourceP);
+			for (GA_Iterator it(r); !it.atEnd(); ++it) { moved_points[*it] = p_h.get(*it) != source_h.get(*it); }
+		});
+		/// a point sharing a primitive with a moved point is in its one-ring
+		UTparallelFor(GA_SplittableRange(gd->getPointRange()), [&](const GA_SplittableRange& r)
+		{
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				bool update = moved_points[*it];
+				for (GA_Size a = adj_start[*it]; a < adj_start[*it + 1] && !update; ++a)
+				{
+					const GA_OffsetListRef& vertices = gd->getPrimitiveVertexList(adj_prims[a]);
+					for (GA_Size v = 0; v < vertices.size() && !update; ++v) { update = moved_points[gd->vertexPoint(vertices(v))]; }
+				}
+				update_points[*it] = update;
+			}
+		});
+		/// every primitive around an updated point, collected per task: the group is only filled with those
+		std::vector<GA_Offset> dirty_prims;
+		std::mutex dirty_lock;
+		UTparallelFor(GA_SplittableRange(gd->getPrimitiveRange()), [&](const GA_SplittableRange& r)
+		{
+			std::vector<GA_Offset> found;
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				const GA_OffsetListRef& vertices = gd->getPrimitiveVertexList(*it);
+				for (GA_Size v = 0; v < vertices.size(); ++v)
+				{
+					if (update_points[gd->vertexPoint(vertices(v))]) { found.push_back(*it); break; }
+				}
+			}
+			if (found.empty()) { return; }
+			std::lock_guard<std::mutex> guard(dirty_lock);
+			dirty_prims.insert(dirty_prims.end(), found.begin(), found.end());
+		});
+		if (dirty_prims.empty()) { return; }
+
+		GA_PrimitiveGroup* dirty_group = gd->newInternalPrimitiveGroup();
+		for (auto prim : dirty_prims) { dirty_group->addOffset(prim); }
+		// a point of the group on its border sees only part of its primitives: computed aside, only updated points are copied
+		GA_Attribute* scratch = gd->addFloatTuple(GA_ATTRIB_POINT, GA_SCOPE_PRIVATE, "__dirtyN", 3);
+		gd->normal(GA_RWHandleV3(scratch), dirty_group);
+		GA_Attribute* nattrib = gd->addNormalAttribute(GA_ATTRIB_POINT);
+		// N of a segment shares pages with the base until written
+		nattrib->hardenAllPages();
+		UTparallelFor(GA_SplittableRange(gd->getPointRange()), [&](const GA_SplittableRange& r)
+		{
+			GA_RWHandleV3 n_h(nattrib);
+			GA_ROHandleV3 scratch_h(scratch);
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				if (update_points[*it]) { n_h.set(*it, scratch_h.get(*it)); }
+			}
+		});
+		nattrib->bumpDataId();
+		gd->destroyPrimitiveGroup(dirty_group);
+		gd->getAttributes().destroyAttribute(scratch);
+	}
+
+}
+
+
+//** stage mask
+
+// an invalid expression selects nothing
+bool CVEXStageMask::parse(const UT_StringHolder& str)
+{
+	*this = CVEXStageMask();
+	if (!str.isstring()) { return true; }
+	source = str;
+	if (str.c_str()[0] != '@')
+	{
+		group = str;
+		return true;
+	}
+
+	/// @attr<op>value
+	std::string expr(str.c_str() + 1);
+	size_t oppos = expr.find_first_of("<>=!");
+	if (oppos == 0 || oppos == std::string::npos) { return false; }
+	size_t valpos = expr.find_first_not_of("<>=!", oppos);
+	if (valpos == std::string::npos) { return false; }
+	op = expr.substr(oppos, valpos - oppos);
+	if (op != ">" && op != "<" && op != ">=" && op != "<=" && op != "==" && op != "!=") { return false; }
+	attrib = UT_StringHolder(expr.substr(0, oppos));
+	value = atof(expr.c_str() + valpos);
+	return true;
+}
+
+GA_Range CVEXStageMask::range(int runtype, const GU_Detail *gd) const
+{
+	if (isEmpty() || runtype == DO_DETAILS) { return elementRange(runtype, gd); }
+	GA_AttributeOwner owner = runtypeOwner(runtype);
+	GA_OffsetList selected;
+
+	/// group of the run type owner
+	if (group.isstring())
+	{
+		const GA_ElementGroup* elemgroup = gd->findElementGroup(owner, group);
+		if (elemgroup) { return GA_Range(*elemgroup); }
+		VRAYwarningOnce("Stage group %s not found, the stage is skipped.", group.c_str());
+		return GA_Range(gd->getIndexMap(owner), selected);
+	}
+
+	/// attribute threshold, offsets in order so contiguous selections stay in blocks
+	GA_ROHandleD attrib_h(gd->findAttribute(owner, attrib));
+	if (!attrib_h.isValid())
+	{
+		VRAYwarningOnce("Stage mask %s has no valid attribute, the stage is skipped.", source.c_str());
+		return GA_Range(gd->getIndexMap(owner), selected);
+	}
+	for (GA_Iterator it(elementRange(runtype, gd)); !it.atEnd(); ++it)
+	{
+		fpreal64 v = attrib_h.get(*it);
+		bool pass = (op == ">") ? v > value : 
+			(op == "<") ? v < value : 
+			(op == ">=") ? v >= value : 
+			(op == "<=") ? v <= value : 
+			(op == "==") ? v == value : v != value;
+		if (pass) { selected.append(*it); }
+	}
+	return GA_Range(gd->getIndexMap(owner), selected);
+}
+
+
+//** child procedural: deformer for single instance
+
+RAY_Deform::RAY_Deform(const UT_Matrix4D& xform, UT_StringHolder infile, GU_Detail* ingd,
+	const std::vector<UT_StringHolder>& cfiles, const CVEXExtraAttribMap& cextra,
+	const std::vector<int>& cruntypes, const RAY_DeformKernelList& ckernels, 
+	const std::vector<CVEXStageMask>& cmasks, const std::vector<CVEXStageInfo>& cinfos, int cvexn, int isMultiT, int ins,
+	int compN, int isVB, int isDVB, int geoTSample, int batchSeg, 
+	std::shared_ptr<RAY_AssetStages> assetStages, int compress, 
+	std::shared_ptr<const RAY_AttribFilter> filter, int stripAttribs, const UT_StringHolder& keepAttribs, 
+	fpreal open, fpreal close, fpreal fps,
+	const int* polyframeflags, const GU_PolyFrameParms& pf_parms, 
+	std::shared_ptr<const std::atomic<bool>> interrupt):
+
+	isSuccess(true), 
+	is_interrupted(false), 
+	interrupt_flag(interrupt), 
+	discarded_chunks(0), 
+	is_geoCommanded(false), 
+	instance_xform(xform), 
+	instance_xformF(xform), 
+	inputfile(infile), 
+	prefetched_gd(ingd), 
+	cvexfiles(cfiles), 
+	cvex_extraAttribs(cextra), 
+	cvex_runtypes(cruntypes), 
+	cvex_kernels(ckernels), 
+	cvex_masks(cmasks), 
+	stage_infos(cinfos), 
+	instance_id(ins), 
+	cvex_num(cvexn), 
+	is_multi_threads(isMultiT), 
+	is_compute_normal(compN), 
+	is_velBlur(isVB), 
+	is_deformVelBlur(isDVB), 
+	geo_timeSample(geoTSample), 
+	asset_stage_cache(assetStages), 
+	is_batchSegments(batchSeg), 
+	compress_mode(compress), 
+	is_filterAttribs(filter != nullptr), 
+	attrib_filter(filter), 
+	is_stripAttribs(stripAttribs), 
+	keep_attribs(keepAttribs), 
+	camShutter_open(open),
+	camShutter_close(close), 
+	fps(fps), 
+	polyframe_parms(pf_parms)
+{
+	std::copy(polyframeflags, polyframeflags + CVEX_MAX_NUM + 1, polyframe_flags);
+	// parms only point at their names: keep copies alive with the child
+	for (int i = 0; i < 3; ++i)
+	{
+		if (!pf_parms.names[i]) { continue; }
+		polyframe_names[i] = pf_parms.names[i];
+		polyframe_parms.names[i] = polyframe_names[i].c_str();
+	}
+	if (pf_parms.uv_name)
+	{
+		polyframe_uvname = pf_parms.uv_name;
+		polyframe_parms.uv_name = polyframe_uvname.c_str();
+	}
+	bbox.initBounds(0.0, 0.0, 0.0);
+	placements.push_back(instance_xform);
+	if (preprocess() == 0) { isSuccess = false; }	// calculate bbox during child construction
+	asset_stage_cache.reset();	// only read while deforming
+}
+
+RAY_Deform::~RAY_Deform()
+{
+}
+
+const char* RAY_Deform::className() const
+{
+	return "RAY_Deform";
+}
+
+// child procedural: this function never be called
+int RAY_Deform::initialize(const UT_BoundingBox *box)
+{
+	return 0;
+}
+
+void RAY_Deform::getBoundingBox(UT_BoundingBox &box)
+{
+	// asset space bound under every object transform
+	for (const auto& xform : placements)
+	{
+		UT_BoundingBox xbox(bbox);
+		xbox.transform(UT_Matrix4R(xform));
+		box.enlargeBounds(xbox);
+	}
+}
+
+bool RAY_Deform::checkInterrupt()
+{
+	if (!is_interrupted && interrupt_flag && *interrupt_flag) { is_interrupted = true; }
+	return is_interrupted;
+}
+
+void RAY_Deform::addPlacement(const UT_Matrix4D& xform)
+{
+	placements.push_back(xform);
+}
+
+void RAY_Deform::render()
+{
+	if (!isSuccess) { return; }
+
+	/// restore compressed storage
+	if (compress_mode > 0)
+	{
+		std::vector<GU_Detail*> gdlist(1, geo.get());
+		for (auto& handle : segment_handles) { gdlist.push_back(handle.gdpNC()); }
+		uncompressGeo(gdlist);
+		segment_handles.clear();
+	}
+
+	/// motion blur
+	// velocity motion blur: can only run in render() somehow...
+	if (is_velBlur || is_deformVelBlur)
+	{
+		/// motion blur
+		fpreal preBlur, postBlur;
+		velocityBlurWindow(preBlur, postBlur);
+		geo.addVelocityBlur(preBlur, postBlur);
+	}
+
+	// placed by object transform, one geometry is shared by every identical instance
+	for (const auto& xform : placements)
+	{
+		VRAY_ProceduralChildPtr obj = createChild();
+		obj->setPreTransform(xform, 0);
+		obj->addGeometry(geo);
+	}
+}
+
+bool RAY_Deform::probeCVEX(const UT_StringHolder& cvexfile, const CVEXExtraAttribMap& extras, CVEXStageInfo& info)
+{
+	// native kernels only see P and N
+	if (RAY_DeformKernel::isNative(cvexfile))
+	{
+		info = CVEXStageInfo();
+		return true;
+	}
+
+	CVEX_Context context;
+	/// declare the uniform inputs the deformer binds
+	context.addInput("instance", CVEX_TYPE_INTEGER, false);
+	context.addInput("shutter", CVEX_TYPE_FLOAT, false);
+	context.addInput("instancexform", CVEX_TYPE_MATRIX4, false);
+	context.addInput("worldP", CVEX_TYPE_VECTOR3, true);
+	for (const auto & attribinfo : extras.floatAttribMap)	{ context.addInput(attribinfo.first, CVEX_TYPE_FLOAT, false); }
+	for (const auto & attribinfo : extras.intAttribMap)		{ context.addInput(attribinfo.first, CVEX_TYPE_INTEGER, false); }
+	for (const auto & attribinfo : extras.vec3AttribMap)	{ context.addInput(attribinfo.first, CVEX_TYPE_VECTOR3, false); }
+	for (const auto & attribinfo : extras.vec4AttribMap)	{ context.addInput(attribinfo.first, CVEX_TYPE_VECTOR4, false); }
+
+	/// load cvex
+	UT_String shoppath(UT_String::ALWAYS_DEEP, cvexfile.c_str());
+	char* argv[4096];
+	int argc = shoppath.parse(argv, 4096);
+	if (!context.load(argc, argv)) { return false; }
+
+	/// inputs bound to a parameter of the program
+	info.reads_instance = context.findInput("instance", CVEX_TYPE_INTEGER) != nullptr;
+	info.reads_shutter = context.findInput("shutter", CVEX_TYPE_FLOAT) != nullptr;
+	info.reads_world = context.findInput("instancexform", CVEX_TYPE_MATRIX4) != nullptr || 
+		context.findInput("worldP", CVEX_TYPE_VECTOR3) != nullptr;
+	info.extras.clear();
+	info.params.clear();
+	info.exports.clear();
+	CVEX_ValueList& inputs = context.getInputList();
+	for (int i = 0; i < inputs.entries(); ++i) { info.params.push_back(inputs.getValue(i)->getName()); }
+	CVEX_ValueList& outputs = context.getOutputList();
+	for (int i = 0; i < outputs.entries(); ++i)
+	{
+		if (outputs.getValue(i)->isExport()) { info.exports.push_back(outputs.getValue(i)->getName()); }
+	}
+	for (const auto & attribinfo : extras.floatAttribMap)	{ if (context.findInput(attribinfo.first, CVEX_TYPE_FLOAT)) { info.extras.push_back(attribinfo.first); } }
+	for (const auto & attribinfo : extras.intAttribMap)		{ if (context.findInput(attribinfo.first, CVEX_TYPE_INTEGER)) { info.extras.push_back(attribinfo.first); } }
+	for (const auto & attribinfo : extras.vec3AttribMap)	{ if (context.findInput(attribinfo.first, CVEX_TYPE_VECTOR3)) { info.extras.push_back(attribinfo.first); } }
+	for (const auto & attribinfo : extras.vec4AttribMap)	{ if (context.findInput(attribinfo.first, CVEX_TYPE_VECTOR4)) { info.extras.push_back(attribinfo.first); } }
+	// stable key order regardless of map iteration
+	std::sort(info.extras.begin(), info.extras.end());
+	return true;
+}
+
+/// preprocess
+
+int RAY_Deform::preprocess()
+{
+	std::vector<fpreal32> shutterlist;
+	shutterlist.push_back((fpreal32)camShutter_open);		// default shutter time for no motion blur is 0.0
+
+	/// stage inputs decide which leading stages can be shared
+	fpreal shutter_time = camShutter_close - camShutter_open;
+	bool is_segmented = !is_velBlur && !is_deformVelBlur && geo_timeSample > 1 && shutter_time > 0.0;
+	const std::vector<CVEXStageInfo>& stageinfos = stage_infos;
+	int invariant_stages = invariantStages(stageinfos);
+	int time_stages = (is_segmented || is_deformVelBlur) ? invariant_stages : 0;
+	int asset_stages = asset_stage_cache ? instanceIndependentStages(stageinfos) : 0;
+	bool asset_time_dep = asset_stages > invariant_stages;	// a shared stage reads shutter: keyed on it
+	if (asset_time_dep && is_deformVelBlur)
+	{
+		// the shutter close pass would need the shared stages at close too
+		asset_stages = time_stages;
+		asset_time_dep = false;
+	}
+	bool segment_states = asset_time_dep && is_segmented;	// one state per segment shutter
+
+	/// an asset state another instance built replaces loading the file
+	int first_stage = 0;
+	if (asset_stages > 0 && !segment_states)
+	{
+		GU_DetailHandle state = findAssetState(assetStateKey(shutterlist[0], asset_stages, asset_time_dep));
+		if (state.isValid())
+		{
+			delete prefetched_gd;
+			prefetched_gd = nullptr;
+			geo = createGeometry();
+			GU_DetailHandleAutoReadLock rlock(state);
+			geo->replaceWith(*rlock.getGdp());
+			first_stage = asset_stages;
+		}
+	}
+
+	/// load geo from file
+	if (first_stage == 0)
+	{
+		if (!loadGeo(attrib_filter.get())) { return 0; }
+	}
+	GU_Detail* gd = geo.get();
+	std::vector<GU_Detail*> gdlist;
+	gdlist.push_back(gd);
+
+	// a state already carries the source P snapshot
+	int normal_mode = is_compute_normal ? normalMode(stageinfos, gd) : NORMALS_SKIP;
+	if (normal_mode == NORMALS_DIRTY && first_stage == 0)
+	{
+		// P as loaded, shares its pages until a stage writes them
+		GA_Attribute* sourceP = gd->addFloatTuple(GA_ATTRIB_POINT, GA_SCOPE_PRIVATE, "__sourceP", 3);
+		sourceP->replace(*gd->getP());
+		// element counts as loaded: geometry commands changing them invalidate the one-ring
+		GA_RWHandleI topo_h(gd->addIntTuple(GA_ATTRIB_DETAIL, GA_SCOPE_PRIVATE, "__sourceTopology", 3));
+		topo_h.set(GA_Offset(0), 0, (int)gd->getNumPoints());
+		topo_h.set(GA_Offset(0), 1, (int)gd->getNumPrimitives());
+		topo_h.set(GA_Offset(0), 2, (int)gd->getNumVertices());
+	}
+	// topology as the stages start from it, shared by every segment
+	if (normal_mode == NORMALS_DIRTY) { buildAdjacency(gd, adj_start, adj_prims); }
+
+	/// instance-independent leading stages: start from the asset's shared state
+	GU_Detail rawgd;	// undeformed source, per-segment shared states are built from it
+	if (asset_stages > 0 && first_stage == 0)
+	{
+		if (segment_states) { rawgd.replaceWith(*gd); }
+		if (assetState(gd, *gd, shutterlist[0], asset_stages, asset_time_dep)) { first_stage = asset_stages; }
+		if (is_interrupted) { return 0; }
+	}
+
+	/// shutter-independent leading stages run once on the base, before segments copy it
+	if (time_stages > first_stage)
+	{
+		CVEXSegmentData sd;
+		runStages(sd, gd, shutterlist.data(), first_stage, time_stages);
+		if (is_interrupted) { return 0; }
+		VRAYprintf(2, "%s: %d of %d stages don't read shutter, run once for all segments.", 
+			inputfile.c_str(), time_stages, (int)cvexfiles.size());
+		first_stage = time_stages;
+	}
+
+	/// motion blur
+	if (!is_velBlur && !is_deformVelBlur)
+	{
+		if (geo_timeSample > 0 && shutter_time > 0.0)
+		{
+			fpreal shutter_step;
+			if (geo_timeSample <= 1) { shutter_step = 0; }
+			else
+			{
+				shutter_step = shutter_time / (geo_timeSample - 1);
+			}
+			for (int i = 1; i < geo_timeSample; ++i)
+			{
+				fpreal curr_shutter_norm = (i * shutter_step) / shutter_time;
+
+				auto g1 = geo.appendSegmentGeometry(curr_shutter_norm);	// pass normalized shutter (scale from 0 to 1)
+				GU_DetailHandleAutoWriteLock wlock(g1);
+				// segment starts as a copy of the undeformed base: topology and attribute pages are shared,
+				// only the pages the deform writes (P, N, cvex outputs) get their own copy
+				wlock.getGdp()->replaceWith(*gd);
+				segment_handles.push_back(g1);
+				shutterlist.push_back((fpreal32)(camShutter_open + i * shutter_step));
+				gdlist.push_back(wlock.getGdp());
+			}
+		}
+	}
+
+	// keep P before the shutter-dependent stages for the shutter close pass of deformation velocity
+	GA_Attribute* restP = nullptr;
+	GA_Offset rest_end = GA_Offset(0);	// points from here on are created later by gvex and have no rest P
+	if (is_deformVelBlur)
+	{
+		restP = gd->addFloatTuple(GA_ATTRIB_POINT, GA_SCOPE_PRIVATE, "__restP", 3);
+		restP->replace(*gd->getP());
+		rest_end = GA_Offset(gd->getNumPointOffsets());
+	}
+
+	/// execute cvex on different shutter GU_Details
+	// segments have no dependency on each other: deform them concurrently,
+	// chunk-level cvex tasks nest inside each segment task
+	std::vector<CVEXSegmentData> segmentdata(gdlist.size());	// indexed by segment id
+	if (is_batchSegments && gdlist.size() > 1 && !segment_states)
+	{
+		deformBatched(gdlist, shutterlist, first_stage);
+	}
+	else
+	{
+		UTparallelFor(UT_BlockedRange<int>(0, (int)gdlist.size()), [&](const UT_BlockedRange<int>& r)
+		{
+			for (int guid = r.begin(); guid != r.end(); ++guid)
+			{
+				if (checkInterrupt()) { return; }
+				int segment_first = first_stage;
+				// shared stages read shutter: the segment takes the asset's state at its own shutter
+				if (guid > 0 && segment_states && first_stage > 0 && 
+					!assetState(gdlist[guid], rawgd, shutterlist[guid], first_stage, true))
+				{
+					gdlist[guid]->replaceWith(rawgd);
+					segment_first = 0;
+				}
+				deformSegment(segmentdata[guid], gdlist[guid], shutterlist.data() + guid, segment_first);
+			}
+		});
+	}
+	if (is_interrupted) { return 0; }
+
+	/// deformation velocity
+	if (is_deformVelBlur)
+	{
+		deformVelocity(segmentdata[0], gd, restP, rest_end, first_stage);
+		gd->getAttributes().destroyAttribute(restP);
+		if (is_interrupted) { return 0; }
+	}
+
+	/// re-compute normal
+	if (normal_mode != NORMALS_SKIP && !checkInterrupt())
+	{
+		computeNormals(gdlist, normal_mode == NORMALS_DIRTY);
+		if (is_interrupted) { return 0; }
+	}
+	// the child waits for render: no need to keep the adjacency
+	std::vector<GA_Size>().swap(adj_start);
+	std::vector<GA_Offset>().swap(adj_prims);
+
+	/// scratch attributes of the stages are not handed to mantra
+	if (is_stripAttribs) { stripAttribs(gdlist, stageinfos); }
+
+	/// update bbox
+	geoBBox(gd, bbox);
+	if (is_velBlur || is_deformVelBlur)
+	{
+		// update bbox based on "v" attribute
+		velBBox(gd, bbox);
+	}
+	else
+	{
+		// add bbox from segment geo: bound segments concurrently, merge afterwards
+		std::vector<UT_BoundingBox> segmentBBoxes(gdlist.size());
+		UTparallelFor(UT_BlockedRange<int>(1, (int)gdlist.size()), [&](const UT_BlockedRange<int>& r)
+		{
+			for (int guid = r.begin(); guid != r.end(); ++guid)
+			{
+				geoBBox(gdlist[guid], segmentBBoxes[guid]);
+			}
+		});
+		for (int guid = 1; guid < gdlist.size(); ++guid)
+		{
+			bbox.enlargeBounds(segmentBBoxes[guid]);
+		}
+	}
+
+	/// compress finished geometry until render
+	if (compress_mode > 0)
+	{
+		int64 raw_size = 0;
+		int64 compressed_size = 0;
+		for (auto segment_gd : gdlist) { raw_size += segment_gd->getMemoryUsage(true); }
+		compressGeo(gdlist, stageinfos);
+		for (auto segment_gd : gdlist) { compressed_size += segment_gd->getMemoryUsage(true); }
+		VRAYprintf(2, "Compress %s: %.1f MB to %.1f MB.", inputfile.c_str(), raw_size / (1024.0 * 1024.0), compressed_size / (1024.0 * 1024.0));
+	}
+
+	return 1;
+}
+
+void RAY_Deform::deformSegment(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter, int first_stage)
+{
+	runStages(sd, gd, shutter, first_stage, (int)cvexfiles.size());
+}
+
+void RAY_Deform::deformBatched(std::vector<GU_Detail*>& gdlist, std::vector<fpreal32>& shutterlist, int first_stage)
+{
+	CVEXSegmentData sd;
+	sd.batch_gds = gdlist;
+	sd.batch_shutters = shutterlist;
+	GU_Detail* gd = gdlist[0];	// attribute layout and topology are the same in every segment
+	int segment_num = (int)gdlist.size();
+	auto forSegments = [&](const std::function<void(int)>& body)
+	{
+		UTparallelFor(UT_BlockedRange<int>(0, segment_num), [&](const UT_BlockedRange<int>& r)
+		{
+			for (int guid = r.begin(); guid != r.end(); ++guid) { body(guid); }
+		});
+	};
+
+	/// pre polyframe
+	if (first_stage == 0 && polyframe_flags[0]) { forSegments([&](int guid) { polyFrame(gdlist[guid]); }); }
+
+	/// execute different cvex files, all segments per run
+	for (int i = first_stage; i < cvexfiles.size(); ++i)
+	{
+		if (checkInterrupt()) { break; }
+		sd.inputcvex = cvexfiles[i];
+		sd.cvex_runtype = cvex_runtypes[i];
+		sd.mask = &cvex_masks[i];
+
+		if (RAY_DeformKernel::isNative(sd.inputcvex)) { forSegments([&](int guid) { runKernel(i, gdlist[guid]); }); }
+		else if (sd.cvex_runtype == DO_DETAILS)
+		{
+			// a single element per segment: nothing to batch
+			for (int guid = 0; guid < segment_num; ++guid)
+			{
+				executeDetailCVEX(sd, gdlist[guid], &shutterlist[guid]);
+				cleanBuffer(sd);
+			}
+		}
+		else if (sd.cvex_runtype == DO_POINTS || sd.cvex_runtype == DO_PRIMS || sd.cvex_runtype == DO_VERTS)
+			{ executeCVEX(sd, gd, &shutterlist[0]); }
+		else { VRAYprintf(0, "No valid cvex. Create geometry instance only."); }
+		cleanBuffer(sd);
+
+		// post polyframe after each cvex
+		if (polyframe_flags[i + 1] && !is_interrupted) { forSegments([&](int guid) { polyFrame(gdlist[guid]); }); }
+
+		// segments created their own geometry and may no longer match: the rest runs per segment
+		if (sd.batch_topology && i + 1 < cvexfiles.size() && !is_interrupted)
+		{
+			VRAYprintf(2, "%s: CVEX %s created geometry, later stages run per segment.", inputfile.c_str(), sd.inputcvex.c_str());
+			forSegments([&](int guid)
+			{
+				CVEXSegmentData segment_sd;
+				runStages(segment_sd, gdlist[guid], &shutterlist[guid], i + 1, (int)cvexfiles.size());
+			});
+			break;
+		}
+	}
+	releaseGeoCommand(sd);
+}
+
+void RAY_Deform::runStages(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter, int begin, int end)
+{
+	/// pre polyframe
+	if (begin == 0 && polyframe_flags[0])	{ polyFrame(gd); }
+
+	/// execute different cvex files
+	for (int i = begin; i < end; ++i)
+	{
+		if (checkInterrupt()) { break; }
+		// RAYprintf(0, "=== Start execute cvex id: %d ===", i);
+		sd.inputcvex = cvexfiles[i];
+		sd.cvex_runtype = cvex_runtypes[i];
+		sd.mask = &cvex_masks[i];
+
+		// execute cvex
+		if (runKernel(i, gd)) {}
+		else if (sd.cvex_runtype == DO_POINTS || sd.cvex_runtype == DO_PRIMS || sd.cvex_runtype == DO_VERTS || sd.cvex_runtype == DO_DETAILS) 
+			{ executeCVEX(sd, gd, shutter); }
+		else { VRAYprintf(0, "No valid cvex. Create geometry instance only."); }
+
+		// clean buffer for cvex
+		cleanBuffer(sd);
+
+		// post polyframe after each cvex
+		if (polyframe_flags[i + 1] && !is_interrupted) { polyFrame(gd); }
+	}
+
+	releaseGeoCommand(sd);
+}
+
+bool RAY_Deform::runKernel(int i, GU_Detail *gd)
+{
+	if (!RAY_DeformKernel::isNative(cvexfiles[i])) { return false; }
+	// an invalid kernel was reported when it was created: the stage does nothing
+	if (cvex_kernels[i]) { cvex_kernels[i]->run(gd, cvex_masks[i].range(DO_POINTS, gd)); }
+	return true;
+}
+
+int RAY_Deform::invariantStages(const std::vector<CVEXStageInfo>& stageinfos)
+{
+	// a stage after a shutter-dependent one sees varying input: only a leading run is invariant
+	int stage_num = 0;
+	for (const auto& info : stageinfos)
+	{
+		if (info.reads_shutter) { break; }
+		stage_num++;
+	}
+	return stage_num;
+}
+
+int RAY_Deform::instanceIndependentStages(const std::vector<CVEXStageInfo>& stageinfos)
+{
+	// same leading-run rule: a later stage sees instance-dependent input
+	int stage_num = 0;
+	for (const auto& info : stageinfos)
+	{
+		if (info.reads_instance || info.reads_world || !info.extras.empty()) { break; }
+		stage_num++;
+	}
+	return stage_num;
+}
+
+std::string RAY_Deform::assetStateKey(fpreal32 shutter, int stage_num, bool time_dep)
+{
+	/// asset, how it was loaded, the shared stages and their polyframes, shutter if a stage reads it
+	auto str = [](const UT_StringHolder& s) { return s.isstring() ? s.c_str() : ""; };
+	UT_WorkBuffer keybuf;
+	keybuf.append(inputfile.c_str());
+	keybuf.appendSprintf("|filter=%d|%s|normals=%d", is_filterAttribs, is_filterAttribs ? str(keep_attribs) : "", is_compute_normal);
+	keybuf.appendSprintf("|pf=%d,%d,%d,%s,%s,%s,%s", (int)polyframe_parms.which, (int)polyframe_parms.style, (int)polyframe_parms.orthogonal, 
+		str(polyframe_names[0]), str(polyframe_names[1]), str(polyframe_names[2]), str(polyframe_uvname));
+	keybuf.appendSprintf("|%d", polyframe_flags[0]);
+	for (int i = 0; i < stage_num; ++i)
+	{
+		keybuf.appendSprintf("|%s|%d|%s|%d", cvexfiles[i].c_str(), cvex_runtypes[i], cvex_masks[i].source.c_str(), polyframe_flags[i + 1]);
+	}
+	if (time_dep) { keybuf.appendSprintf("|shutter=%.9g", shutter); }
+	return std::string(keybuf.buffer());
+}
+
+GU_DetailHandle RAY_Deform::findAssetState(const std::string& key)
+{
+	GU_DetailHandle state;
+	std::lock_guard<std::mutex> guard(asset_stage_cache->lock);
+	auto it = asset_stage_cache->entries.find(key);
+	if (it != asset_stage_cache->entries.end() && it->second.status == RAY_AssetStages::READY)
+	{
+		state = it->second.state;
+		asset_stage_cache->hits++;
+	}
+	return state;
+}
+
+bool RAY_Deform::assetState(GU_Detail *gd, const GU_Detail& source, fpreal32 shutter, int stage_num, bool time_dep)
+{
+	std::string key = assetStateKey(shutter, stage_num, time_dep);
+
+	/// first instance of the asset builds the state
+	// others arriving while it builds run their own stages: waiting inside nested parallel
+	// tasks could block a thread on work it stole itself
+	GU_DetailHandle state;
+	{
+		std::lock_guard<std::mutex> guard(asset_stage_cache->lock);
+		RAY_AssetStages::Entry& entry = asset_stage_cache->entries[key];
+		if (entry.status == RAY_AssetStages::BUILDING) { return false; }
+		if (entry.status == RAY_AssetStages::READY) { state = entry.state; }
+		else { entry.status = RAY_AssetStages::BUILDING; }
+	}
+	if (state.isValid()) { asset_stage_cache->hits++; }
+	else
+	{
+		GU_Detail* stategd = new GU_Detail();
+		stategd->replaceWith(source);
+		CVEXSegmentData sd;
+		fpreal32 state_shutter = shutter;
+		runStages(sd, stategd, &state_shutter, 0, stage_num);
+		std::lock_guard<std::mutex> guard(asset_stage_cache->lock);
+		RAY_AssetStages::Entry& entry = asset_stage_cache->entries[key];
+		if (is_interrupted)
+		{
+			// not usable, a later instance rebuilds it
+			delete stategd;
+			entry.status = RAY_AssetStages::EMPTY;
+			return false;
+		}
+		entry.state.allocateAndSet(stategd);
+		entry.status = RAY_AssetStages::READY;
+		state = entry.state;
+		asset_stage_cache->builds++;
+	}
+
+	GU_DetailHandleAutoReadLock rlock(state);
+	gd->replaceWith(*rlock.getGdp());
+	return true;
+}
+
+void RAY_Deform::deformVelocity(CVEXSegmentData& sd, GU_Detail *gd, GA_Attribute* restP, GA_Offset rest_end, int first_stage)
+{
+	fpreal shutter_time = camShutter_close - camShutter_open;
+	if (shutter_time <= 0.0) { return; }
+
+	// keep shutter open P, start again from P before the shutter-dependent stages
+	GA_Attribute* openP = gd->addFloatTuple(GA_ATTRIB_POINT, GA_SCOPE_PRIVATE, "__openP", 3);
+	openP->replace(*gd->getP());
+	gd->getP()->replace(*restP);
+
+	/// P-writing stages only, at shutter close
+	// other attributes are read as they were left by the shutter open pass
+	fpreal32 close_shutter = (fpreal32)camShutter_close;
+	sd.p_only = true;
+	for (int i = first_stage; i < cvexfiles.size(); ++i)
+	{
+		if (checkInterrupt()) { break; }
+		sd.inputcvex = cvexfiles[i];
+		sd.cvex_runtype = cvex_runtypes[i];
+		sd.mask = &cvex_masks[i];
+		if (runKernel(i, gd)) {}
+		else if (sd.cvex_runtype == DO_POINTS || sd.cvex_runtype == DO_PRIMS || sd.cvex_runtype == DO_VERTS || sd.cvex_runtype == DO_DETAILS) 
+			{ executeCVEX(sd, gd, &close_shutter); }
+		cleanBuffer(sd);
+	}
+	sd.p_only = false;
+	releaseGeoCommand(sd);
+	if (is_interrupted)
+	{
+		gd->getAttributes().destroyAttribute(openP);
+		return;
+	}
+
+	/// v = displacement over the shutter, in units per second
+	GA_Attribute* vel = gd->addFloatTuple(GA_ATTRIB_POINT, GA_SCOPE_PUBLIC, "v", 3);
+	vel->setTypeInfo(GA_TYPE_VECTOR);
+	vel->hardenAllPages();
+	fpreal32 inv_time = (fpreal32)(fps / shutter_time);
+	const GA_Attribute* closeP = gd->getP();
+	UTparallelFor(GA_SplittableRange(gd->getPointRange()), [&](const GA_SplittableRange& r)
+	{
+		GA_ROPageHandleV3 open_ph(openP);
+		GA_ROPageHandleV3 close_ph(closeP);
+		GA_RWPageHandleV3 vel_ph(vel);
+		GA_Offset start, end;
+		for (GA_Iterator it(r); it.blockAdvance(start, end); )
+		{
+			open_ph.setPage(start);
+			close_ph.setPage(start);
+			vel_ph.setPage(start);
+			for (GA_Offset off = start; off < end; ++off)
+			{
+				// created by the shutter open pass: no close position, no velocity
+				if (off >= rest_end) { vel_ph.value(off) = UT_Vector3(0, 0, 0); }
+				else { vel_ph.value(off) = (close_ph.value(off) - open_ph.value(off)) * inv_time; }
+			}
+		}
+	});
+
+	// rendered P stays at shutter open
+	gd->getP()->replace(*openP);
+	gd->getAttributes().destroyAttribute(openP);
+}
+
+void RAY_Deform::resizeBuffer(CVEXSegmentData& sd, int chunk_num)
+{
+	// set buffer for each chunk
+	sd.inputbuffer.resize(chunk_num);
+	sd.vec3_outputbuffer.resize(chunk_num);
+	sd.float_outputbuffer.resize(chunk_num);
+	sd.vec4_outputbuffer.resize(chunk_num);
+	sd.int_outputbuffer.resize(chunk_num);
+	// geometry command queues are kept across stages, only grow
+	if ((int)sd.geocmdpool.size() < chunk_num)
+	{
+		sd.geocmdpool.resize(chunk_num, nullptr);
+		sd.geocmd_gds.resize(chunk_num, nullptr);
+	}
+}
+
+void RAY_Deform::cleanBuffer(CVEXSegmentData& sd)
+{
+	// delete inputs
+	for (auto buffer : sd.inputbuffer)
+	{
+		for (auto pt : buffer)
+		{
+			delete[] pt;
+		}
+		buffer.clear();
+	}
+	sd.inputbuffer.clear();
+	// delete outputs
+	for (auto buffer : sd.vec3_outputbuffer)
+	{
+		for (const auto& attribinfo : buffer)
+		{
+			delete[] attribinfo.second;
+		}
+		buffer.clear();
+	}
+	for (auto buffer : sd.float_outputbuffer)
+	{
+		for (const auto& attribinfo : buffer)
+		{
+			delete[] attribinfo.second;
+		}
+		buffer.clear();
+	}
+	for (auto buffer : sd.vec4_outputbuffer)
+	{
+		for (const auto& attribinfo : buffer)
+		{
+			delete[] attribinfo.second;
+		}
+		buffer.clear();
+	}
+	for (auto buffer : sd.int_outputbuffer)
+	{
+		for (const auto& attribinfo : buffer)
+		{
+			delete[] attribinfo.second;
+		}
+		buffer.clear();
+	}
+	sd.vec3_outputbuffer.clear();
+	sd.float_outputbuffer.clear();
+	sd.vec4_outputbuffer.clear();
+	sd.int_outputbuffer.clear();
+	// delete attribute holder
+	sd.geoattriblist.clear();
+	sd.cvexoutputnamelist.clear();
+}
+
+/// Geo
+
+bool RAY_Deform::loadGeo(const RAY_AttribFilter* filter)
+{
+	// prefetched by the loader: already filtered on its io thread
+	if (prefetched_gd)
+	{
+		geo = createGeometry(prefetched_gd);
+		prefetched_gd = nullptr;
+		return true;
+	}
+
+	geo = createGeometry();
+	
+	// Load geometry from disk, through the host cache when enabled
+	if (!RAY_DeformCache::load(geo.get(), inputfile, filter))
+	{
+		VRAYerror("Unable to load geometry[0]: %s", inputfile.c_str());
+		return false;
+	}
+	// RAYprintf(0, "Load geometry[0] success: %s", inputfile.c_str());
+	
+	return true;
+}
+
+/// normals
+
+int RAY_Deform::normalMode(const std::vector<CVEXStageInfo>& stageinfos, const GU_Detail *gd)
+{
+	/// last stage moving P and last stage authoring N
+	int last_p = -1;
+	int last_n = -1;
+	bool masked = true;
+	for (int i = 0; i < stageinfos.size(); ++i)
+	{
+		const CVEXStageInfo& info = stageinfos[i];
+		bool native = RAY_DeformKernel::isNative(cvexfiles[i]);
+		// a stage that can't be probed may write anything
+		bool unknown = info.probe_failed;
+		auto exports = [&](const char* name) { return std::find(info.exports.begin(), info.exports.end(), name) != info.exports.end(); };
+		if (native || unknown || exports("P"))
+		{
+			last_p = i;
+			masked = masked && !cvex_masks[i].isEmpty() && (native || cvex_runtypes[i] == DO_POINTS);
+		}
+		if (!unknown && exports("N")) { last_n = i; }
+	}
+
+	const GA_Attribute* sourceN = gd->findPointAttribute("N");
+	if (last_p < 0) { return (sourceN || gd->findVertexAttribute("N")) ? NORMALS_SKIP : NORMALS_FULL; }
+	if (last_n >= last_p) { return NORMALS_SKIP; }
+	return (masked && sourceN) ? NORMALS_DIRTY : NORMALS_FULL;
+}
+
+void RAY_Deform::computeNormals(std::vector<GU_Detail*>& gdlist, bool dirty_only)
+{
+	/// segments in parallel, each one parallel over its elements
+	UTparallelFor(UT_BlockedRange<int>(0, (int)gdlist.size()), [&](const UT_BlockedRange<int>& r)
+	{
+		for (int guid = r.begin(); guid != r.end(); ++guid)
+		{
+			if (checkInterrupt()) { return; }
+			GU_Detail* gd = gdlist[guid];
+			GA_Attribute* sourceP = gd->findPointAttribute(GA_SCOPE_PRIVATE, "__sourceP");
+			GA_Attribute* topology = gd->findAttribute(GA_ATTRIB_DETAIL, GA_SCOPE_PRIVATE, "__sourceTopology");
+			GA_ROHandleI topo_h(topology);
+			bool same_topology = topo_h.isValid() && topo_h.get(GA_Offset(0), 0) == gd->getNumPoints() && 
+				topo_h.get(GA_Offset(0), 1) == gd->getNumPrimitives() && topo_h.get(GA_Offset(0), 2) == gd->getNumVertices() && 
+				(GA_Size)adj_start.size() == gd->getNumPointOffsets() + 1;
+			if (dirty_only && sourceP && same_topology) { dirtyNormals(gd, sourceP, adj_start, adj_prims); }
+			else { gd->normal(); }
+			if (sourceP) { gd->getAttributes().destroyAttribute(sourceP); }
+			if (topology) { gd->getAttributes().destroyAttribute(topology); }
+		}
+	});
+}
+
+/// attribute filtering
+
+std::shared_ptr<RAY_AttribFilter> RAY_Deform::attribFilter(const std::vector<CVEXStageInfo>& stageinfos, 
+	const std::vector<UT_StringHolder>& cfiles, const std::vector<int>& cruntypes, 
+	const std::vector<CVEXStageMask>& cmasks, int isVB, const int* polyframeflags, int cvexn, 
+	const GU_PolyFrameParms& pf_parms, const UT_StringHolder& keepAttribs)
+{
+	/// names a mask or the deformer itself reads, the stages are probed against each attribute table
+	std::shared_ptr<RAY_AttribFilter> filter = std::make_shared<RAY_AttribFilter>();
+	filter->keep = keepAttribs;
+	for (const auto& info : stageinfos) { filter->keep_all = filter->keep_all || info.probe_failed; }
+	for (int i = 0; i < cfiles.size(); ++i)
+	{
+		filter->add(cmasks[i].group);
+		filter->add(cmasks[i].attrib);
+		if (RAY_DeformKernel::isNative(cfiles[i])) { filter->add("N"); }
+		else { filter->stages.push_back(std::make_pair(cfiles[i], cruntypes[i])); }
+	}
+	if (isVB) { filter->add("v"); }
+	for (int i = 0; i <= cvexn && i <= CVEX_MAX_NUM; ++i)
+	{
+		if (!polyframeflags[i]) { continue; }
+		for (int n = 0; n < 3; ++n) { if (pf_parms.names[n]) { filter->add(pf_parms.names[n]); } }
+		if (pf_parms.uv_name) { filter->add(pf_parms.uv_name); }
+		break;
+	}
+	return filter;
+}
+
+bool RAY_Deform::probeGeoAttribs(const UT_StringHolder& cvexfile, int runtype, GU_Detail *gd, std::unordered_map<std::string, bool>& names)
+{
+	GA_AttributeOwner owner;
+	switch (runtype)
+	{
+	case DO_POINTS:		owner = GA_ATTRIB_POINT; break;
+	case DO_PRIMS:		owner = GA_ATTRIB_PRIMITIVE; break;
+	case DO_VERTS:		owner = GA_ATTRIB_VERTEX; break;
+	case DO_DETAILS:	owner = GA_ATTRIB_DETAIL; break;
+	default:			return true;	// never run
+	}
+
+	CVEX_Context context;
+	std::vector<std::pair<GA_Attribute*, CVEX_Type>> declared;
+	for (GA_AttributeDict::iterator it = gd->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+	{
+		CVEX_Type type = attrib2CVEXTypeHandler(it.attrib());
+		if (type == CVEX_TYPE_INVALID) { continue; }
+		context.addInput(it.attrib()->getName(), type, true);
+		declared.push_back(std::make_pair(it.attrib(), type));
+	}
+	UT_String shoppath(UT_String::ALWAYS_DEEP, cvexfile.c_str());
+	char* argv[4096];
+	int argc = shoppath.parse(argv, 4096);
+	if (!context.load(argc, argv)) { return false; }
+	for (const auto& attrib : declared)
+	{
+		if (context.findInput(attrib.first->getName(), attrib.second)) { names[attrib.first->getName().toStdString()] = true; }
+	}
+	return true;
+}
+
+std::string RAY_AttribFilter::key() const
+{
+	if (keep_all) { return "*"; }
+	std::vector<std::string> names;
+	for (const auto& it : needed) { names.push_back(it.first); }
+	std::sort(names.begin(), names.end());
+	std::string result = keep.toStdString();
+	for (const auto& name : names) { result += "|" + name; }
+	for (const auto& stage : stages) { result += "|" + stage.first.toStdString() + "#" + std::to_string(stage.second); }
+	return result;
+}
+
+bool RAY_AttribFilter::boundAttribs(GU_Detail *gd, std::unordered_map<std::string, bool>& names) const
+{
+	/// attribute table: owner, name and cvex type of every public attribute
+	std::vector<std::string> table;
+	const GA_AttributeOwner owners[] = { GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL };
+	for (auto owner : owners)
+	{
+		for (GA_AttributeDict::iterator it = gd->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+		{
+			table.push_back(std::to_string((int)owner) + ":" + it.attrib()->getName().toStdString() + ":" + 
+				std::to_string((int)it.attrib()->getStorageClass()) + ":" + std::to_string(it.attrib()->getTupleSize()));
+		}
+	}
+	std::sort(table.begin(), table.end());
+	std::string table_key;
+	for (const auto& entry : table) { table_key += entry + "|"; }
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = bound_tables.find(table_key);
+		if (it != bound_tables.end())
+		{
+			names = it->second;
+			return !names.empty();
+		}
+	}
+	// probed outside the lock, a concurrent probe of the same table finds the same names
+	bool success = true;
+	for (const auto& stage : stages)
+	{
+		success = success && RAY_Deform::probeGeoAttribs(stage.first, stage.second, gd, names);
+	}
+	// P is always kept: a table whose stages bind nothing still has an entry
+	names["P"] = true;
+	if (!success) { names.clear(); }
+	std::lock_guard<std::mutex> guard(lock);
+	bound_tables[table_key] = names;
+	return success;
+}
+
+void RAY_AttribFilter::apply(GU_Detail *gd, const UT_StringHolder& file) const
+{
+	if (keep_all) { return; }
+	// a stage that can't be loaded may bind anything
+	std::unordered_map<std::string, bool> bound;
+	if (!boundAttribs(gd, bound)) { return; }
+	UT_String keep(UT_String::ALWAYS_DEEP, this->keep.c_str());
+	auto isNeeded = [&](const char* name)
+	{
+		return needed.count(name) > 0 || bound.count(name) > 0 || UT_String(name).multiMatch(keep);
+	};
+
+	/// collect first, the dictionaries can't change while iterated
+	int dropped_attribs = 0;
+	int dropped_groups = 0;
+	const GA_AttributeOwner owners[] = { GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL };
+	for (auto owner : owners)
+	{
+		std::vector<UT_StringHolder> names;
+		for (GA_AttributeDict::iterator it = gd->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+		{
+			const GA_Attribute* attrib = it.attrib();
+			if (attrib != gd->getP() && !isNeeded(attrib->getName())) { names.push_back(attrib->getName()); }
+		}
+		for (const auto& name : names) { gd->destroyAttribute(owner, name); }
+		dropped_attribs += (int)names.size();
+		if (owner == GA_ATTRIB_DETAIL) { continue; }
+
+		names.clear();
+		for (GA_GroupTable::iterator<GA_ElementGroup> it = gd->getElementGroupTable(owner).beginTraverse(); !it.atEnd(); ++it)
+		{
+			const GA_ElementGroup* group = it.group();
+			if (!group->isInternal() && !isNeeded(group->getName())) { names.push_back(group->getName()); }
+		}
+		for (const auto& name : names) { gd->destroyElementGroup(owner, name); }
+		dropped_groups += (int)names.size();
+	}
+	if (dropped_attribs || dropped_groups)
+	{
+		VRAYprintf(2, "%s: dropped %d attributes and %d groups no stage reads.", file.c_str(), dropped_attribs, dropped_groups);
+	}
+}
+
+void RAY_Deform::stripAttribs(std::vector<GU_Detail*>& gdlist, const std::vector<CVEXStageInfo>& stageinfos)
+{
+	/// attributes a stage or polyframe wrote differ per segment, the others still share the base's pages
+	std::unordered_map<std::string, bool> written;
+	bool is_known = writtenAttribs(gdlist, stageinfos, written);
+
+	UT_String keep(UT_String::ALWAYS_DEEP, keep_attribs.c_str());
+	GU_Detail* gd = gdlist[0];
+	int dropped = 0;
+	int narrowed = 0;
+	const GA_AttributeOwner owners[] = { GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL };
+	for (auto owner : owners)
+	{
+		std::vector<UT_StringHolder> dropnames;
+		std::vector<GA_Attribute*> wide;
+		for (GA_AttributeDict::iterator it = gd->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+		{
+			GA_Attribute* attrib = it.attrib();
+			bool kept = attrib == gd->getP() || 
+				((is_velBlur || is_deformVelBlur) && owner == GA_ATTRIB_POINT && attrib->getName() == "v") || 
+				(is_compute_normal && attrib->getName() == "N") || 
+				UT_String(attrib->getName()).multiMatch(keep);
+			if (!kept)
+			{
+				dropnames.push_back(attrib->getName());
+				continue;
+			}
+			// mantra reads 32 bit data natively: 64 bit values only cost memory
+			const GA_AIFTuple* tuple = attrib->getAIFTuple();
+			if (tuple && (tuple->getStorage(attrib) == GA_STORE_REAL64 || tuple->getStorage(attrib) == GA_STORE_INT64))
+			{
+				wide.push_back(attrib);
+			}
+		}
+
+		/// same layout in every segment
+		for (const auto& name : dropnames)
+		{
+			for (auto segmentgd : gdlist) { segmentgd->destroyAttribute(owner, name); }
+		}
+		dropped += (int)dropnames.size();
+
+		for (auto attrib : wide)
+		{
+			const GA_AIFTuple* tuple = attrib->getAIFTuple();
+			GA_Storage storage = tuple->getStorage(attrib) == GA_STORE_REAL64 ? GA_STORE_REAL32 : GA_STORE_INT32;
+			if (storage == GA_STORE_INT32)
+			{
+				// only when every value of every segment fits
+				bool fits = true;
+				for (auto segmentgd : gdlist)
+				{
+					const GA_Attribute* segattrib = segmentgd->findAttribute(owner, attrib->getName());
+					GA_ROHandleT<int64> int_h(segattrib);
+					for (GA_Iterator it(GA_Range(segmentgd->getIndexMap(owner))); fits && int_h.isValid() && !it.atEnd(); ++it)
+					{
+						for (int c = 0; c < segattrib->getTupleSize(); ++c)
+						{
+							int64 value = int_h.get(*it, c);
+							fits = fits && value >= SYS_INT32_MIN && value <= SYS_INT32_MAX;
+						}
+					}
+				}
+				if (!fits) { continue; }
+			}
+			tuple->setStorage(attrib, storage);
+			for (int guid = 1; guid < gdlist.size(); ++guid)
+			{
+				GA_Attribute* segattrib = gdlist[guid]->findAttribute(owner, attrib->getName());
+				if (!segattrib) { continue; }
+				// untouched by the stages: share the converted base again instead of converting a copy
+				if (is_known && !written.count(attrib->getName().toStdString())) { segattrib->replace(*attrib); }
+				else { segattrib->getAIFTuple()->setStorage(segattrib, storage); }
+			}
+			narrowed++;
+		}
+	}
+	if (dropped || narrowed)
+	{
+		VRAYprintf(2, "%s: stripped %d attributes, %d converted to 32 bit.", inputfile.c_str(), dropped, narrowed);
+	}
+}
+
+/// storage compression
+
+bool RAY_Deform::writtenAttribs(const std::vector<GU_Detail*>& gdlist, const std::vector<CVEXStageInfo>& stageinfos, std::unordered_map<std::string, bool>& written)
+{
+	// setattrib, addpoint, removepoint... are not in the exports
+	bool known = !is_geoCommanded;
+	for (auto segment_gd : gdlist)
+	{
+		known = known && segment_gd->getNumPoints() == gdlist[0]->getNumPoints() && 
+			segment_gd->getNumPrimitives() == gdlist[0]->getNumPrimitives() && 
+			segment_gd->getNumVertices() == gdlist[0]->getNumVertices();
+	}
+	for (int i = 0; i < stageinfos.size(); ++i)
+	{
+		known = known && !stageinfos[i].probe_failed;
+		for (const auto& name : stageinfos[i].exports) { written[name.toStdString()] = true; }
+		if (RAY_DeformKernel::isNative(cvexfiles[i])) { written["P"] = true; }
+	}
+	for (int n = 0; n < 3; ++n) { if (polyframe_names[n].isstring()) { written[polyframe_names[n].toStdString()] = true; } }
+	written["N"] = true;
+	return known;
+}
+
+bool RAY_Deform::compressAttrib(GU_Detail *gd, GA_Attribute* attrib)
+{
+	// quantize 32 bit floats to 16 bit, P only in the lossiest mode
+	bool quantized = false;
+	const GA_AIFTuple* tuple = attrib->getAIFTuple();
+	bool is_P = (attrib == gd->getP());
+	if (compress_mode >= 2 && tuple && attrib->getStorageClass() == GA_STORECLASS_FLOAT && 
+		tuple->getStorage(attrib) == GA_STORE_REAL32 && (!is_P || compress_mode >= 3))
+	{
+		quantized = tuple->setStorage(attrib, GA_STORE_REAL16);
+	}
+	// pages holding a single value collapse to one element
+	attrib->tryCompressAllPages();
+	return quantized;
+}
+
+void RAY_Deform::compressGeo(std::vector<GU_Detail*>& gdlist, const std::vector<CVEXStageInfo>& stageinfos)
+{
+	std::unordered_map<std::string, bool> written;
+	bool is_known = writtenAttribs(gdlist, stageinfos, written);
+	auto record = [](std::vector<std::pair<GA_AttributeOwner, UT_StringHolder>>& list, GA_AttributeOwner owner, const UT_StringHolder& name)
+	{
+		auto entry = std::make_pair(owner, name);
+		if (std::find(list.begin(), list.end(), entry) == list.end()) { list.push_back(entry); }
+	};
+	GU_Detail* gd = gdlist[0];
+	const GA_AttributeOwner owners[] = { GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE };
+	for (auto owner : owners)
+	{
+		for (GA_AttributeDict::iterator it = gd->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+		{
+			if (compressAttrib(gd, it.attrib())) { record(quantized_attribs, owner, it.attrib()->getName()); }
+		}
+		for (int guid = 1; guid < gdlist.size(); ++guid)
+		{
+			GU_Detail* segment_gd = gdlist[guid];
+			for (GA_AttributeDict::iterator it = segment_gd->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+			{
+				GA_Attribute* attrib = it.attrib();
+				const GA_Attribute* base_attrib = gd->findAttribute(owner, attrib->getName());
+				// never written: take the base's converted pages instead of converting a private copy
+				if (base_attrib && is_known && !written.count(attrib->getName().toStdString()))
+				{
+					attrib->replace(*base_attrib);
+					record(shared_attribs, owner, attrib->getName());
+				}
+				// written per segment, or created by a segment only
+				else if (compressAttrib(segment_gd, attrib)) { record(quantized_attribs, owner, attrib->getName()); }
+			}
+		}
+	}
+}
+
+void RAY_Deform::uncompressGeo(std::vector<GU_Detail*>& gdlist)
+{
+	GU_Detail* gd = gdlist[0];
+	for (int guid = 0; guid < gdlist.size(); ++guid)
+	{
+		for (const auto& attribinfo : quantized_attribs)
+		{
+			GA_Attribute* attrib = gdlist[guid]->findAttribute(attribinfo.first, attribinfo.second);
+			if (!attrib) { continue; }
+			const GA_AIFTuple* tuple = attrib->getAIFTuple();
+			bool shared = guid > 0 && 
+				std::find(shared_attribs.begin(), shared_attribs.end(), attribinfo) != shared_attribs.end();
+			const GA_Attribute* base_attrib = gd->findAttribute(attribinfo.first, attribinfo.second);
+			// shared with the base: restored there once, shared again
+			if (shared && base_attrib) { attrib->replace(*base_attrib); }
+			else if (tuple) { tuple->setStorage(attrib, GA_STORE_REAL32); }
+		}
+	}
+}
+
+/// bbox
+
+void RAY_Deform::geoBBox(const GU_Detail *gd, UT_BoundingBox& box)
+{
+	box.initBounds();
+	// non-polygonal primitives (spheres, volumes, packed...) can exceed their points
+	if (!isPointBounded(gd))
+	{
+		gd->getBBox(&box);
+		return;
+	}
+	PointBoundReducer reducer(gd->getP(), nullptr, 0.0f, 0.0f);
+	UTparallelReduce(GA_SplittableRange(gd->getPointRange()), reducer);
+	reducer.enlarge(box);
+}
+
+void RAY_Deform::velocityBlurWindow(fpreal& preBlur, fpreal& postBlur) const
+{
+	// deformation velocity: P is already at shutter open, v spans open to close
+	if (is_deformVelBlur)
+	{
+		preBlur = 0.0;
+		postBlur = (camShutter_close - camShutter_open) / fps;
+		return;
+	}
+	// input v: P is at frame time
+	preBlur = -(camShutter_open) / fps;
+	postBlur = (camShutter_close) / fps;
+}
+
+void RAY_Deform::velBBox(const GU_Detail *gd, UT_BoundingBox& box)
+{
+	// traverse the geo and cal pos displacement based on "v" attribute
+	const GA_Attribute* vel = gd->findPointAttribute("v");
+	if (!vel || vel->getStorageClass() != GA_STORECLASS_FLOAT || vel->getTupleSize() < 3)
+	{
+		VRAYwarningOnce("Velocity blur: attribute v is not valid.");
+		return;
+	}
+	fpreal preBlur, postBlur;
+	velocityBlurWindow(preBlur, postBlur);
+	PointBoundReducer reducer(gd->getP(), vel, (fpreal32)preBlur, (fpreal32)postBlur);
+	UTparallelReduce(GA_SplittableRange(gd->getPointRange()), reducer);
+	reducer.enlarge(box);
+}
+
+/// PolyFrame
+
+void RAY_Deform::polyFrame(GU_Detail *gd)
+{
+	GU_PolyFrame polyframe(gd);
+    GU_PolyFrameError err = polyframe.computeFrames(polyframe_parms);
+	switch (err)
+	{
+	case GU_POLYFRAME_CREATE_ATTRIBUTE_FAILED:
+		VRAYerror("PolyFrame create attribute failed.");
+		break;
+	case GU_POLYFRAME_MISSING_DETAIL:
+		VRAYerror("PolyFrame missing detail.");
+		break;
+	case GU_POLYFRAME_MISSING_TEXTURE_COORDS:
+		VRAYerror("PolyFrame missing texture coords.");
+		break;
+	default:
+		break;
+	}
+}
+
+
+/// CVEX
+
+void RAY_Deform::executeCVEX(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter)
+{
+	/// detail: single element, no chunking
+	if (sd.cvex_runtype == DO_DETAILS)
+	{
+		executeDetailCVEX(sd, gd, shutter);
+		return;
+	}
+
+	// cvextype: 0-points, 1-primitives, 2-vertices
+	// offsets may be fragmented: work on page-bounded contiguous blocks of the range, gaps are skipped
+	std::vector<CVEXBlock> blocks;
+	if (sd.batch_gds.empty()) { collectBlocks(sd.mask->range(sd.cvex_runtype, gd), blocks); }
+	else
+	{
+		// batched: blocks of every segment back to back, tagged with their segment
+		for (int guid = 0; guid < sd.batch_gds.size(); ++guid)
+		{
+			size_t first = blocks.size();
+			collectBlocks(sd.mask->range(sd.cvex_runtype, sd.batch_gds[guid]), blocks);
+			for (size_t b = first; b < blocks.size(); ++b) { blocks[b].segment = guid; }
+		}
+	}
+	if (blocks.empty()) { return; }
+
+	/// single thread
+	if (!is_multi_threads)
+	{
+		// batched: one chunk per segment, so a gvex queue holds the commands of one detail
+		std::vector<CVEXChunk> chunks(1);
+		for (const auto& block : blocks)
+		{
+			if (chunks.back().size > 0 && chunks.back().blocks.back().segment != block.segment) { chunks.push_back(CVEXChunk()); }
+			chunks.back().append(block);
+		}
+		resizeBuffer(sd, (int)chunks.size());
+		// init
+		CVEX_Context cvex;
+		CVEX_RunData rundata;
+		UT_Array<exint> procid(chunks[0].size, chunks[0].size);
+		fillProcId(sd, gd, chunks[0], procid);
+		rundata.setProcId(procid.array());
+		rundata.setGeoCommandQueue(acquireGeoCommand(sd, blockDetail(sd, gd, chunks[0].blocks[0]), 0));
+		bool is_loaded = processCVEX(sd, cvex, rundata, gd, chunks[0], 0, shutter);
+		for (int tid = 1; is_loaded && tid < (int)chunks.size(); ++tid)
+		{
+			executeChunkCVEX(sd, gd, tid, chunks[tid], *shutter, nullptr, nullptr);
+		}
+		// gvex
+		applyGeoCommand(sd, gd, (int)chunks.size());
+
+		return;
+	}
+
+	/// multi threads
+	// parse geom attributes
+	getGeomAttribs(sd, gd);	// only run before multi-threads
+	CVEX_Context cvex;
+	// add cvex input
+	addCVEXInput(sd, cvex);
+	// load cvex
+	if (!loadCVEX(sd, cvex)) { return; }
+	// create new outputs based on cvex function and create corresponding attrib for geom
+	createGeomAttribFromCVEXOutput(sd, cvex, gd);	// only run before multi-threads
+	// velocity pass: stage doesn't write P
+	if (sd.p_only && sd.cvexoutputnamelist.empty()) { return; }
+
+	// first chunk is the first page and runs timed on this thread
+	std::vector<CVEXChunk> chunks(1);
+	int block_num = (int)blocks.size();
+	int bid = 0;
+	GA_Offset first_page = blocks[0].start >> GA_PAGE_BITS;
+	for (; bid < block_num && (blocks[bid].start >> GA_PAGE_BITS) == first_page && blocks[bid].segment == blocks[0].segment; ++bid)
+	{
+		chunks[0].append(blocks[bid]);
+	}
+	int remaining = 0;
+	for (int i = bid; i < block_num; ++i) { remaining += blocks[i].size; }
+	resizeBuffer(sd, 1);
+	fpreal64 setup_time = 0.0;
+	fpreal64 run_time = 0.0;
+	executeChunkCVEX(sd, gd, 0, chunks[0], *shutter, &setup_time, &run_time);
+
+	// remaining chunks are sized from the measured cost, closed only on page boundaries
+	if (remaining > 0 && !checkInterrupt())
+	{
+		int chunk_size = adaptiveChunkSize(remaining, chunks[0].size, setup_time, run_time);
+		chunks.push_back(CVEXChunk());
+		for (; bid < block_num; ++bid)
+		{
+			CVEXChunk& chunk = chunks.back();
+			chunk.append(blocks[bid]);
+			// a chunk only closes where the next block starts a new page, and always between segments
+			bool last = bid + 1 == block_num;
+			bool segment_end = !last && blocks[bid + 1].segment != blocks[bid].segment;
+			bool page_end = last || segment_end || (blocks[bid + 1].start >> GA_PAGE_BITS) != (blocks[bid].start >> GA_PAGE_BITS);
+			if (!last && (segment_end || (page_end && chunk.size >= chunk_size))) { chunks.push_back(CVEXChunk()); }
+		}
+		resizeBuffer(sd, (int)chunks.size());
+
+		// chunks run as tasks on the shared scheduler, so they nest inside the segment tasks
+		fpreal32 chunk_shutter = *shutter;
+		UTparallelFor(UT_BlockedRange<int>(1, (int)chunks.size()), [&](const UT_BlockedRange<int>& r)
+		{
+			for (int tid = r.begin(); tid != r.end(); ++tid)
+			{
+				// remaining chunks are dropped once interrupted, their buffers are freed with the stage
+				if (checkInterrupt())
+				{
+					discarded_chunks++;
+					continue;
+				}
+				executeChunkCVEX(sd, gd, tid, chunks[tid], chunk_shutter, nullptr, nullptr);
+			}
+		});
+	}
+	if (is_interrupted) { return; }
+	// gvex
+	applyGeoCommand(sd, gd, (int)chunks.size());
+}
+
+void RAY_Deform::executeDetailCVEX(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter)
+{
+	// parse geom attributes
+	getGeomAttribs(sd, gd);
+	CVEX_Context cvex;
+	// add cvex input
+	addCVEXInput(sd, cvex);
+	// load cvex
+	if (!loadCVEX(sd, cvex)) { return; }
+	// create new outputs based on cvex function and create corresponding attrib for geom
+	createGeomAttribFromCVEXOutput(sd, cvex, gd);
+	// velocity pass: stage doesn't write P
+	if (sd.p_only && sd.cvexoutputnamelist.empty()) { return; }
+
+	/// bind detail attributes as single values, no chunk buffers
+	findUniformCVEX(cvex, shutter);
+	DetailValues<UT_Vector3> vec3_values;
+	DetailValues<fpreal32> float_values;
+	DetailValues<UT_Vector4> vec4_values;
+	DetailValues<int> int_values;
+	bindTypedDetail(sd, cvex, gd, vec3_values);
+	bindTypedDetail(sd, cvex, gd, float_values);
+	bindTypedDetail(sd, cvex, gd, vec4_values);
+	bindTypedDetail(sd, cvex, gd, int_values);
+
+	// run in this thread, a geometry queue is only applied when the program issued commands
+	CVEX_RunData rundata;
+	exint procid = 0;
+	rundata.setProcId(&procid);
+	VEX_GeoCommandQueue geocmd;
+	geocmd.myNumPrim = gd->getNumPrimitives();
+	geocmd.myNumVertex = gd->getNumVertices();
+	geocmd.myNumPoint = gd->getNumPoints();
+	rundata.setGeoCommandQueue(&geocmd);
+	cvex.run(1, true, &rundata);
+
+	/// write back in place
+	writeTypedDetail(gd, vec3_values);
+	writeTypedDetail(gd, float_values);
+	writeTypedDetail(gd, vec4_values);
+	writeTypedDetail(gd, int_values);
+	if (!geocmd.isEmpty() && !sd.p_only)
+	{
+		GVEX_GeoCommand allcmd;
+		allcmd.appendQueue(geocmd);
+		allcmd.apply(gd);
+		is_geoCommanded = true;
+		if (!sd.batch_gds.empty()) { sd.batch_topology = true; }
+	}
+}
+
+void RAY_Deform::executeChunkCVEX(CVEXSegmentData& sd, GU_Detail *gd, int tid, const CVEXChunk& chunk, fpreal32 shutter, fpreal64* setup_time, fpreal64* run_time)
+{
+	UT_StopWatch timer;
+	timer.start();
+
+	// init
+	CVEX_Context cvex;
+	CVEX_RunData rundata;
+
+	// set gvex queue
+	UT_Array<exint> procid(chunk.size, chunk.size);
+	rundata.setProcId(procid.array());
+	rundata.setGeoCommandQueue(acquireGeoCommand(sd, blockDetail(sd, gd, chunk.blocks[0]), tid));
+
+	// set procid with prim/point/vertex id
+	fillProcId(sd, gd, chunk, procid);
+	// run cvex processing
+	addCVEXInput(sd, cvex);
+	// load cvex
+	if (!loadCVEX(sd, cvex)) { return; }
+	// allocate memory for input and output
+	findCVEX(sd, cvex, gd, chunk, tid, &shutter);
+	fpreal64 setup_end = timer.lap();
+	// run cvex program
+	cvex.run(chunk.size, true, &rundata);
+	fpreal64 run_end = timer.lap();
+	// pass cvex result back to geom
+	setCVEXOutput(sd, cvex, gd, chunk, tid);
+
+	// setup covers context, load, marshalling in and out
+	if (setup_time)	{ *setup_time = timer.lap() - (run_end - setup_end); }
+	if (run_time)	{ *run_time = run_end - setup_end; }
+}
+
+void RAY_Deform::fillProcId(const CVEXSegmentData& sd, const GU_Detail *gd, const CVEXChunk& chunk, UT_Array<exint>& procid)
+{
+	// element index of every offset: blocks are contiguous in offsets, not necessarily in indices
+	int i = 0;
+	for (const auto& block : chunk.blocks)
+	{
+		// batched: index within the block's own segment
+		const GA_IndexMap& indexmap = (sd.batch_gds.empty() ? gd : sd.batch_gds[block.segment])->getIndexMap(runtypeOwner(sd.cvex_runtype));
+		// indices follow offsets: a block of live offsets is a run of consecutive indices
+		if (indexmap.isMonotonicMap())
+		{
+			GA_Index first = indexmap.indexFromOffset(block.start);
+			for (int j = 0; j < block.size; ++j, ++i) { procid(i) = first + j; }
+			continue;
+		}
+		GA_Offset end = block.start + block.size;
+		for (GA_Offset off = block.start; off < end; ++off, ++i)
+		{
+			procid(i) = indexmap.indexFromOffset(off);
+		}
+	}
+}
+
+VEX_GeoCommandQueue* RAY_Deform::acquireGeoCommand(CVEXSegmentData& sd, GU_Detail *gd, int tid)
+{
+	// queues left empty by a previous stage are reused
+	VEX_GeoCommandQueue*& geocmd = sd.geocmdpool[tid];
+	if (!geocmd) { geocmd = new VEX_GeoCommandQueue(); }
+	sd.geocmd_gds[tid] = gd;
+	geocmd->myNumPrim = gd->getNumPrimitives();
+	geocmd->myNumVertex = gd->getNumVertices();
+	geocmd->myNumPoint = gd->getNumPoints();
+	return geocmd;
+}
+
+void RAY_Deform::applyGeoCommand(CVEXSegmentData& sd, GU_Detail *gd, int chunk_num)
+{
+	// most stages never create geometry: skip empty queues, and the apply when all are empty
+	// non-empty queues are appended in chunk order, which numbers the new elements
+	// batched chunks never span segments: each segment gets the commands of its own queues
+	std::vector<GU_Detail*> targets;
+	for (int tid = 0; tid < chunk_num; ++tid)
+	{
+		VEX_GeoCommandQueue* geocmd = sd.geocmdpool[tid];
+		if (geocmd && !geocmd->isEmpty() && std::find(targets.begin(), targets.end(), sd.geocmd_gds[tid]) == targets.end())
+		{
+			targets.push_back(sd.geocmd_gds[tid]);
+		}
+	}
+	if (targets.empty()) { return; }
+	// velocity pass must keep the topology of the shutter open pass
+	if (!sd.p_only)
+	{
+		for (auto target : targets)
+		{
+			GVEX_GeoCommand allcmd;
+			for (int tid = 0; tid < chunk_num; ++tid)
+			{
+				VEX_GeoCommandQueue* geocmd = sd.geocmdpool[tid];
+				if (geocmd && !geocmd->isEmpty() && sd.geocmd_gds[tid] == target) { allcmd.appendQueue(*geocmd); }
+			}
+			allcmd.apply(target);
+		}
+		is_geoCommanded = true;
+		if (!sd.batch_gds.empty()) { sd.batch_topology = true; }
+	}
+
+	// queues which carried commands are not reused
+	for (int tid = 0; tid < chunk_num; ++tid)
+	{
+		VEX_GeoCommandQueue*& geocmd = sd.geocmdpool[tid];
+		if (geocmd && !geocmd->isEmpty())
+		{
+			delete geocmd;
+			geocmd = nullptr;
+		}
+	}
+}
+
+void RAY_Deform::releaseGeoCommand(CVEXSegmentData& sd)
+{
+	for (auto geocmd : sd.geocmdpool)
+	{
+		delete geocmd;
+	}
+	sd.geocmdpool.clear();
+}
+
+bool RAY_Deform::processCVEX(CVEXSegmentData& sd, CVEX_Context &context, CVEX_RunData &rundata, GU_Detail *gd, const CVEXChunk& chunk, int tid, fpreal32* shutter)
+{
+	// parse geom attrib
+	getGeomAttribs(sd, gd);
+	// add cvex input
+	addCVEXInput(sd, context);
+	// load cvex
+	if (!loadCVEX(sd, context)) { return false; }
+	// create new outputs based on cvex function and create corresponding attrib for geom
+	createGeomAttribFromCVEXOutput(sd, context, gd);
+	// velocity pass: stage doesn't write P
+	if (sd.p_only && sd.cvexoutputnamelist.empty()) { return true; }
+	// allocate memory for input and output
+	findCVEX(sd, context, gd, chunk, tid, shutter);
+
+	// run cvex program
+	context.run(chunk.size, true, &rundata);
+	// pass cvex result back to geom
+	setCVEXOutput(sd, context, gd, chunk, tid);
+
+	return true;
+}
+
+void RAY_Deform::getGeomAttribs(CVEXSegmentData& sd, GU_Detail *gd)
+{
+	/// get geom attributes
+	// cvextype: 0-points, 1-primitives, 2-vertices
+	switch (sd.cvex_runtype)
+	{
+		// points
+	case DO_POINTS:
+	{
+		for (GA_AttributeDict::iterator it = gd->pointAttribs().begin(); !it.atEnd(); ++it)
+		{
+			sd.geoattriblist.push_back(it.attrib());
+		}
+		break;
+	}
+	// prims
+	case DO_PRIMS:
+	{
+		for (GA_AttributeDict::iterator it = gd->primitiveAttribs().begin(); !it.atEnd(); ++it)
+		{
+			sd.geoattriblist.push_back(it.attrib());
+		}
+		break;
+	}
+	// verts
+	case DO_VERTS:
+	{
+		for (GA_AttributeDict::iterator it = gd->vertexAttribs().begin(); !it.atEnd(); ++it)
+		{
+			sd.geoattriblist.push_back(it.attrib());
+		}
+		break;
+	}
+	case DO_DETAILS:
+	{
+		for (GA_AttributeDict::iterator it = gd->attribs().begin(); !it.atEnd(); ++it)
+		{
+			sd.geoattriblist.push_back(it.attrib());
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void RAY_Deform::addCVEXInput(CVEXSegmentData& sd, CVEX_Context &context)
+{
+	/// add instance and shutter as uniform input
+	// batched segments: shutter differs per element
+	context.addInput("instance", CVEX_TYPE_INTEGER, false);
+	context.addInput("shutter", CVEX_TYPE_FLOAT, !sd.batch_gds.empty());
+	/// geometry stays in asset space, world position through the instance transform
+	context.addInput("instancexform", CVEX_TYPE_MATRIX4, false);
+	if (sd.cvex_runtype == DO_POINTS) { context.addInput("worldP", CVEX_TYPE_VECTOR3, true); }
+
+	/// add extra uniform input
+	for (const auto & attribinfo : cvex_extraAttribs.floatAttribMap)
+	{
+		context.addInput(attribinfo.first, CVEX_TYPE_FLOAT, false);
+	}
+	for (const auto & attribinfo : cvex_extraAttribs.intAttribMap)
+	{
+		context.addInput(attribinfo.first, CVEX_TYPE_INTEGER, false);
+	}
+	for (const auto & attribinfo : cvex_extraAttribs.vec3AttribMap)
+	{
+		context.addInput(attribinfo.first, CVEX_TYPE_VECTOR3, false);
+	}
+	for (const auto & attribinfo : cvex_extraAttribs.vec4AttribMap)
+	{
+		context.addInput(attribinfo.first, CVEX_TYPE_VECTOR4, false);
+	}
+	/// add cvex inputs from geom attributes
+	for (auto attrib : sd.geoattriblist)
+	{
+		CVEX_Type type = attrib2CVEXTypeHandler(attrib);
+		if (type != CVEX_TYPE_INVALID)
+		{
+			context.addInput(attrib->getName(), attrib2CVEXTypeHandler(attrib), true);
+		}
+	}
+}
+
+bool RAY_Deform::loadCVEX(CVEXSegmentData& sd, CVEX_Context &context)
+{
+	// pass shoppath
+	UT_String shoppath = UT_String(sd.inputcvex);
+
+	/// load cvex
+	char* argv[4096];
+	int argc = shoppath.parse(argv, 4096);
+	if (!context.load(argc, argv))	// Pass arguments to CVEX
+	{
+		VRAYerrorOnce("CVEX %s as runtype %d: Cannot load CVEX.", sd.inputcvex.c_str(), sd.cvex_runtype);
+		return false;
+	}
+	// VRAYprintf(0, "Load cvex success: %s", shoppath.c_str());
+	return true;
+}
+
+void RAY_Deform::findCVEX(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, const CVEXChunk& chunk, int tid, fpreal32* shutter)
+{
+	/// set uniform inputs
+	findUniformCVEX(context, shutter);
+	if (!sd.batch_gds.empty()) { findShutterCVEX(sd, context, chunk, tid); }
+	if (sd.cvex_runtype == DO_POINTS) { findWorldPCVEX(sd, context, gd, chunk, tid); }
+	/// set geom attrib inputs and outputs
+	findTypedCVEX(sd, context, gd, sd.vec3_outputbuffer, chunk, tid);
+	findTypedCVEX(sd, context, gd, sd.float_outputbuffer, chunk, tid);
+	findTypedCVEX(sd, context, gd, sd.vec4_outputbuffer, chunk, tid);
+	findTypedCVEX(sd, context, gd, sd.int_outputbuffer, chunk, tid);
+}
+
+void RAY_Deform::findUniformCVEX(CVEX_Context &context, fpreal32* shutter)
+{
+	/// set instance input
+	findTypedUniformInput(context, "instance", &instance_id);
+	findTypedUniformInput(context, "shutter", shutter);
+	findTypedUniformInput(context, "instancexform", &instance_xformF);
+
+	/// set extra uniform input
+	for (const auto & attribinfo : cvex_extraAttribs.floatAttribMap)
+	{
+		findTypedUniformInput(context, attribinfo.first, (fpreal32*)&(attribinfo.second));
+	}
+	for (const auto & attribinfo : cvex_extraAttribs.intAttribMap)
+	{
+		findTypedUniformInput(context, attribinfo.first, (int*)&(attribinfo.second));
+	}
+	for (const auto & attribinfo : cvex_extraAttribs.vec3AttribMap)
+	{
+		findTypedUniformInput(context, attribinfo.first, (UT_Vector3*)&(attribinfo.second));
+	}
+	for (const auto & attribinfo : cvex_extraAttribs.vec4AttribMap)
+	{
+		findTypedUniformInput(context, attribinfo.first, (UT_Vector4*)&(attribinfo.second));
+	}
+}
+
+void RAY_Deform::findShutterCVEX(CVEXSegmentData& sd, CVEX_Context &context, const CVEXChunk& chunk, int tid)
+{
+	CVEX_Value* val = context.findInput("shutter", CVEX_TYPE_FLOAT);
+	if (!val) { return; }
+	fpreal32* shutter_list = new fpreal32[chunk.size];
+	sd.inputbuffer[tid].push_back((void*)shutter_list);
+	int i = 0;
+	for (const auto& block : chunk.blocks)
+	{
+		std::fill(shutter_list + i, shutter_list + i + block.size, sd.batch_shutters[block.segment]);
+		i += block.size;
+	}
+	val->setTypedData(shutter_list, chunk.size);
+}
+
+void RAY_Deform::findWorldPCVEX(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, const CVEXChunk& chunk, int tid)
+{
+	CVEX_Value* val = context.findInput("worldP", CVEX_TYPE_VECTOR3);
+	if (!val) { return; }
+	UT_Vector3* worldp_list = new UT_Vector3[chunk.size];
+	sd.inputbuffer[tid].push_back((void*)worldp_list);
+	int i = 0;
+	for (const auto& block : chunk.blocks)
+	{
+		GA_ROHandleV3 handle(blockDetail(sd, gd, block)->getP());
+		GA_Offset end = block.start + block.size;
+		for (GA_Offset offset = block.start; offset < end; ++offset, ++i)
+		{
+			worldp_list[i] = handle.get(offset) * instance_xformF;
+		}
+	}
+	val->setTypedData(worldp_list, chunk.size);
+}
+
+void RAY_Deform::setCVEXOutput(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, const CVEXChunk& chunk, int tid)
+{
+	/// set geom attrib outputs back to geom
+	setTypedCVEXOutput(sd, context, gd, sd.vec3_outputbuffer, chunk, tid);
+	setTypedCVEXOutput(sd, context, gd, sd.float_outputbuffer, chunk, tid);
+	setTypedCVEXOutput(sd, context, gd, sd.vec4_outputbuffer, chunk, tid);
+	setTypedCVEXOutput(sd, context, gd, sd.int_outputbuffer, chunk, tid);
+}
+
+CVEX_Type RAY_Deform::attrib2CVEXTypeHandler(GA_Attribute* attrib)
+{
+	if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 3) { return CVEX_TYPE_FLOAT; }
+	if (attrib->getStorageClass() == GA_STORECLASS_FLOAT && attrib->getTupleSize() < 4) { return CVEX_TYPE_VECTOR3; }
+	if (attrib->getStorageClass() == GA_STORECLASS_FLOAT) { return CVEX_TYPE_VECTOR4; }
+	if (attrib->getStorageClass() == GA_STORECLASS_INT) { return CVEX_TYPE_INTEGER; }
+	return CVEX_TYPE_INVALID;
+}
+
+void RAY_Deform::createGeomAttribFromCVEXOutput(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd)
+{
+	GA_AttributeOwner owner;
+	switch (sd.cvex_runtype)
+	{
+	case DO_POINTS:
+	{
+		owner = GA_ATTRIB_POINT;
+		break;
+	}
+	case DO_PRIMS:
+	{
+		owner = GA_ATTRIB_PRIMITIVE;
+		break;
+	}
+	case DO_VERTS:
+	{
+		owner = GA_ATTRIB_VERTEX;
+		break;
+	}
+	case DO_DETAILS:
+	{
+		owner = GA_ATTRIB_DETAIL;
+		break;
+	}
+	default:
+		VRAYerrorOnce("CVEX %s as runtype %d: Cannot identify CVEX run type.", sd.inputcvex.c_str(), sd.cvex_runtype);
+	}
+
+	// detail stages run once per segment, even batched: only gd is written by this run
+	static const std::vector<GU_Detail*> no_segments;
+	const std::vector<GU_Detail*>& batch_gds = (sd.cvex_runtype == DO_DETAILS) ? no_segments : sd.batch_gds;
+	CVEX_ValueList& value_list = context.getOutputList();
+	CVEX_Value  *value;
+
+	for (int i = 0; i < value_list.entries(); ++i)
+	{
+		value = value_list.getValue(i);
+		// skip output value which is not exported
+		if (!value->isExport())	continue;
+		// create attribute for geom
+		UT_StringHolder name = value->getName();
+		// velocity pass: only P is written back
+		if (sd.p_only && name != "P")	continue;
+		// auto it = std::find_if(sd.geoattriblist.begin(), sd.geoattriblist.end(), [name](const auto& val) {return val->getName() == name; });   // C++14
+		auto it = std::find_if(sd.geoattriblist.begin(), sd.geoattriblist.end(), [name](const GA_Attribute* val) {return val->getName() == name; });
+		// not find the attribute
+		if (!(it != sd.geoattriblist.end()))
+		{
+			int attrib_length = 1;
+			switch (value->getType())
+			{
+				case CVEX_TYPE_VECTOR3:
+				{
+					attrib_length = 3;
+					break;
+				}
+				case CVEX_TYPE_VECTOR4:
+				{
+					attrib_length = 4;
+					break;
+				}
+				default:	// float and int: length = 1
+				{
+					attrib_length = 1;
+					break;
+				}
+			}
+			gd->addFloatTuple(owner, GA_SCOPE_PUBLIC, value->getName(), attrib_length);
+			// batched: every segment receives the output
+			for (auto segment_gd : batch_gds)
+			{
+				if (!segment_gd->findAttribute(owner, name)) { segment_gd->addFloatTuple(owner, GA_SCOPE_PUBLIC, name, attrib_length); }
+			}
+		}
+		// set cvex output list
+		sd.cvexoutputnamelist.push_back(name);
+		// pages may be shared with the base, another segment or a cached asset state:
+		// hardening isn't thread-safe, give the detail its own pages before chunks write them
+		hardenAttrib(gd, owner, name);
+		for (auto segment_gd : batch_gds) { if (segment_gd != gd) { hardenAttrib(segment_gd, owner, name); } }
+	}
+}
+
+void RAY_Deform::hardenAttrib(GU_Detail *gd, GA_AttributeOwner owner, const UT_StringHolder& name)
+{
+	GA_Attribute* attrib = gd->findAttribute(owner, name);
+	if (attrib) { attrib->hardenAllPages(); }
+}
@@ -1,412 +1,677 @@
-
-#ifndef __RAY_Deformer__
-#define __RAY_Deformer__
-
-#include <UT/UT_BoundingBox.h>
-#include <UT/UT_String.h>
-#include <UT/UT_ThreadedAlgorithm.h>
-#include <UT/UT_Lock.h>
-#include <UT/UT_PtrArray.h>
-#include <UT/UT_TaskScope.h>
-#include <UT/UT_Thread.h>
-#include <UT/UT_Array.h>
-#include <UT/UT_Interrupt.h>
-
-#include <VRAY/VRAY_Procedural.h>
-#include <VRAY/VRAY_IO.h>
-#include <VRAY/VRAY_ProceduralFactory.h>
-
-#include <CVEX/CVEX_Context.h>
-#include <CVEX/CVEX_Value.h>
-#include <CVEX/CVEX_ValueList.h>
-#include <VEX/VEX_Error.h>
-#include <GVEX/GVEX_GeoCommand.h>
-
-#include <GA/GA_Handle.h>
-
-#include <GU/GU_Detail.h>
-#include <GEO/GEO_Point.h>
-#include <GEO/GEO_Vertex.h>
-#include <GEO/GEO_Primitive.h>
-#include <GEO/GEO_AttributeHandle.h>
-
-#include <GU/GU_PolyFrame.h>
-
-#include <unordered_map>
-#include <algorithm>
-
-#define CHUCK_SIZE	1024
-#define CVEX_MAX_NUM	4
-
-// match those with Houdini Deformer parm interface
-#define DO_POINTS	0
-#define DO_PRIMS	1
-#define DO_VERTS	2
-#define DO_DETAILS	3
-
-namespace HDK_Deform
-{
-
-	class RAY_Deform;
-
-	struct CVEXProcessData
-	{
-		RAY_Deform* instance_pt;
-		GU_Detail *gd;
-		VEX_GeoCommandQueue** threadcmds;
-		int gid;
-		int tid;
-		int total_size;
-		int threadnum;
-		fpreal32 shutter;
-
-		CVEXProcessData(RAY_Deform* pt, GU_Detail* gd, VEX_GeoCommandQueue** cmds, int tid, int tsize, int num, fpreal32 shut) :
-			instance_pt(pt),
-			gd(gd),
-			threadcmds(cmds),
-			tid(tid),
-			total_size(tsize),
-			threadnum(num),
-			shutter(shut)
-		{}
-	};
-
-	struct CVEXExtraAttribMap
-	{
-		std::unordered_map<UT_StringHolder, UT_Vector3> vec3AttribMap;
-		std::unordered_map<UT_StringHolder, fpreal32> floatAttribMap;
-		std::unordered_map<UT_StringHolder, UT_Vector4> vec4AttribMap;
-		std::unordered_map<UT_StringHolder, int> intAttribMap;
-	};
-
-	class RAY_Deform : public VRAY_Procedural
-	{
-	public:
-		RAY_Deform(UT_Vector3 center, UT_StringHolder infile, 
-			std::vector<UT_StringHolder>& cfiles, CVEXExtraAttribMap& cextra, 
-			std::vector<int>& cruntypes, int cvexn, int isMultiT, int ins,
-			int compN, int isVB, int geoTSample, fpreal open, fpreal close, fpreal fps, 
-			int* polyframeflags, const GU_PolyFrameParms& pf_parms);
-		virtual ~RAY_Deform();
-		virtual const char *className() const;
-		virtual int initialize(const UT_BoundingBox *);
-		virtual void getBoundingBox(UT_BoundingBox &box);
-		virtual void render();
-
-	private:
-		bool isSuccess;	// success status for this procedural preprocessing
-		/// geom boundingbox
-		UT_BoundingBox bbox;
-		/// input parms
-		UT_Vector3 center_pos;
-		UT_StringHolder inputfile;
-		std::vector<UT_StringHolder>& cvexfiles;
-		CVEXExtraAttribMap& cvex_extraAttribs;
-		std::vector<int>& cvex_runtypes;
-		int instance_id;
-		int cvex_num;
-		int is_multi_threads;
-		int is_compute_normal;
-		int is_velBlur;
-		int geo_timeSample;
-		fpreal camShutter_open;
-		fpreal camShutter_close;
-		fpreal fps;
-		int* polyframe_flags;
-		const GU_PolyFrameParms& polyframe_parms;
-		/// cvex files and run types
-		UT_StringHolder inputcvex;
-		int cvex_runtype;	// cvextype: 0-points, 1-primitives, 2-vertices
-		/// input geom
-		VRAY_ProceduralGeo geo;
-		/// cvex parms
-		// attributes list
-		std::vector<GA_Attribute*> geoattriblist;
-		std::vector<UT_StringHolder> cvexoutputnamelist;
-		// cvex input list: buffer to store input for each input attrib
-		std::vector<std::vector<void*>> inputbuffer;	// used for handle memory allocation
-		// cvex output list: buffer to store output for each output attrib
-		template <class T>
-		using AttribMapT = std::unordered_map<UT_StringHolder, T*>;
-		std::vector<AttribMapT<UT_Vector3>> vec3_outputbuffer;		// cvextype: CVEX_TYPE_VECTOR3
-		std::vector<AttribMapT<fpreal32>> float_outputbuffer;		// cvextype: CVEX_TYPE_FLOAT
-		std::vector<AttribMapT<UT_Vector4>> vec4_outputbuffer;		// cvextype: CVEX_TYPE_VECTOR4
-		std::vector<AttribMapT<int>> int_outputbuffer;				// cvextype: CVEX_TYPE_INTEGER
-
-		UT_Lock theLock;
-
-		int preprocess();
-		void cleanBuffer();
-		
-		bool loadGeo();
-		void velBBox(GU_Detail *gd, UT_BoundingBox& box);
-		void polyFrame(GU_Detail *gd);
-
-		/// cvex
-		void executeCVEX(GU_Detail *gd, fpreal32* shutter);
-		// cvex processing
-		bool processCVEX(CVEX_Context &context, CVEX_RunData &rundata, GU_Detail *gd, int gid, int size, int tid, fpreal32* shutter);
-		// get geom attributes
-		void getGeomAttribs(GU_Detail *gd);
-		// set cvex function inputs from geom attributes
-		void addCVEXInput(CVEX_Context &context);
-		// load cvex function
-		bool loadCVEX(CVEX_Context &context);
-		// find cvex function inputs and outputs, allocate memory for output results
-        void findCVEX(CVEX_Context &context, GU_Detail *gd, int gid, int size, int tid, fpreal32* shutter);
-		void setCVEXOutput(CVEX_Context &context, GU_Detail *gd, int gid, int size, int tid);
-		// create new output
-		void createGeomAttribFromCVEXOutput(CVEX_Context &context, GU_Detail *gd);
-
-		// process CVEX separately in thread
-		static void* executeSingleCVEX(void* data)
-		{
-			// depack all the input data
-			CVEXProcessData* input = reinterpret_cast<CVEXProcessData*>(data);
-			RAY_Deform* instance_pt = input->instance_pt;
-			GU_Detail* gd = input->gd;
-			VEX_GeoCommandQueue** threadcmds = input->threadcmds;
-			int tid = input->tid;
-			int thread_num = input->threadnum;
-			int total_size = input->total_size;
-			fpreal32 shutter = input->shutter;
-
-			// init
-			CVEX_Context cvex;
-			CVEX_RunData rundata;
-
-			// set gvex queue
-			UT_Array<exint> procid(CHUCK_SIZE, CHUCK_SIZE);
-			rundata.setProcId(procid.array());
-			VEX_GeoCommandQueue* geocmd = new VEX_GeoCommandQueue();
-			geocmd->myNumPrim = gd->getNumPrimitives();
-			geocmd->myNumVertex = gd->getNumVertices();
-			geocmd->myNumPoint = gd->getNumPoints();
-			rundata.setGeoCommandQueue(geocmd);
-			threadcmds[tid] = geocmd;
-
-			int size = 0;
-			int gid = tid * CHUCK_SIZE;
-			// set procid with prim/point/vertex id
-			for (int i = 0; i < CHUCK_SIZE; ++i)	{ procid(i) = gid + i;}
-			// set buffer size
-			if (tid < thread_num - 1)	{ size = CHUCK_SIZE;}
-			else						{ size = total_size % CHUCK_SIZE;}
-			// run cvex processing
-			{
-				// UT_Lock::Scope lock(instance_pt->theLock);
-				instance_pt->addCVEXInput(cvex);
-				// load cvex
-				if (!instance_pt->loadCVEX(cvex)) { return false; }
-				// allocate memory for input and output
-				instance_pt->findCVEX(cvex, gd, gid, size, tid, &shutter);
-				// run cvex program
-				cvex.run(size, true, &rundata);
-				// pass cvex result back to geom
-				instance_pt->setCVEXOutput(cvex, gd, gid, size, tid);
-			}
-
-			return nullptr;
-		}
-
-		// cvex find typed input and output
-		template <typename T>
-		inline void findTypedUniformInput(CVEX_Context &context, UT_StringHolder name, T* value)
-		{
-			CVEX_Value* var;
-			CVEX_Type type = type2CVEXTypeHandler<T>();
-			var = context.findInput(name, type);
-			if (var)
-			{
-				var->setTypedData(value, 1);
-			}
-		}
-
-		template <typename T>
-		inline void findTypedCVEX(CVEX_Context &context, GU_Detail *gd, std::vector<AttribMapT<T>>& attriblist, int gid, int size, int tid)
-		{
-			GA_AttributeOwner owner;
-			GA_Offset off;
-			switch (cvex_runtype)
-			{
-			case DO_POINTS:
-			{
-				off = gd->pointOffset(GA_Index(gid));
-				owner = GA_ATTRIB_POINT;
-				break;
-			}
-			case DO_PRIMS:
-			{
-				off = gd->primitiveOffset(GA_Index(gid));
-				owner = GA_ATTRIB_PRIMITIVE;
-				break;
-			}
-			case DO_VERTS:
-			{
-				off = gd->vertexOffset(GA_Index(gid));
-				owner = GA_ATTRIB_VERTEX;
-				break;
-			}
-			case DO_DETAILS:
-			{
-				off = 0;
-				owner = GA_ATTRIB_DETAIL;
-				break;
-			}
-			default:
-				VRAYerrorOnce("CVEX %s as runtype %d: Cannot identify CVEX run type.", inputcvex.c_str(), cvex_runtype);
-				return;
-			}
-
-			CVEX_Value* val;
-			CVEX_Value* out;
-			CVEX_Type type = type2CVEXTypeHandler<T>();
-
-			T* attr_list;
-			T* attr_outlist;
-
-			for (auto attrib : geoattriblist)
-			{
-				// check to see whether VEX function has the correspoonding parameter
-				val = context.findInput(attrib->getName(), type);
-				// if input, allocate memory and set input data
-				if (val)
-				{
-					// allocate memory for input attrib
-					attr_list = new T[size];
-					inputbuffer[tid].push_back((void*)attr_list);
-					// set attrib to buffer
-					getTypedAttribByGeom(gd, attrib->getName(), attr_list, owner, off, size);
-					// set cvex input
-					val->setTypedData(attr_list, size);
-					// RAYprintf(0, "Set input attrib %s.", attrib->getName().c_str());
-				}
-			}
-
-			for (auto name : cvexoutputnamelist)
-			{
-				// find output of cvex
-				out = context.findOutput(name, type);
-				if (out)
-				{
-					// allocate memory for output list
-					attr_outlist = new T[size];
-					attriblist[tid][name] = attr_outlist;
-					// link memory buffer to output attrib
-					out->setTypedData(attr_outlist, size);
-					// RAYprintf(0, "Set output attrib %s.", name.c_str());
-				}
-			}
-		}
-
-		// set cvex typed output back to geom attributes
-		template <typename T>
-		inline void setTypedCVEXOutput(CVEX_Context &context, GU_Detail *gd, std::vector<AttribMapT<T>>& attriblist, int gid, int size, int tid)
-		{
-			GA_AttributeOwner owner;
-			GA_Offset off;
-			switch (cvex_runtype)
-			{
-			case DO_POINTS:
-			{
-				off = gd->pointOffset(GA_Index(gid));
-				owner = GA_ATTRIB_POINT;
-				break;
-			}
-			case DO_PRIMS:
-			{
-				off = gd->primitiveOffset(GA_Index(gid));
-				owner = GA_ATTRIB_PRIMITIVE;
-				break;
-			}
-			case DO_VERTS:
-			{
-				off = gd->vertexOffset(GA_Index(gid));
-				owner = GA_ATTRIB_VERTEX;
-				break;
-			}
-			case DO_DETAILS:
-			{
-				off = 0;
-				owner = GA_ATTRIB_DETAIL;
-				break;
-			}
-			default:
-				VRAYerrorOnce("CVEX %s as runtype %d: Cannot identify CVEX run type.", inputcvex.c_str(), cvex_runtype);
-				return;
-			}
-
-			for (const auto &attribinfo : attriblist[tid])
-			{
-				CVEX_Value* out;
-				UT_StringHolder attrib_nam = attribinfo.first;
-				T* outputlist = attribinfo.second;
-				out = context.findOutput(attrib_nam, type2CVEXTypeHandler<T>());
-				setTypedAttribByGeom<T>(gd, attrib_nam, outputlist, owner, off, size);
-				// RAYprintf(0, "Set attrib %s back to geom.", attrib_nam.c_str());
-			}
-		}
-
-		// get typed attributes data from input geom
-		template <typename T>
-		inline bool getTypedAttribByGeom(GU_Detail *gd, UT_StringHolder name, T* inputlist, GA_AttributeOwner owner, GA_Offset off, int size)
-		{
-			GA_ROHandleT<T> handle(gd, owner, name);
-			if (handle.isValid())
-			{
-				T attr;
-				for (int i = 0; i < size; ++i)
-				{
-					GA_Offset offset = off + i;
-					attr = handle.get(offset);
-					inputlist[i] = attr;
-				}
-				return true;
-			}
-			else
-			{
-				VRAYwarningOnce("CVEX %s as runtype %d: Handle for attribute %s is not valid.", inputcvex.c_str(), cvex_runtype, name.c_str());
-				return false;
-			}
-		}
-
-		// set typed attributes data to input geom
-		template <typename T>
-		inline bool setTypedAttribByGeom(GU_Detail *gd, UT_StringHolder name, T* outputlist, GA_AttributeOwner owner, GA_Offset off, int size)
-		{
-			GA_RWHandleT<T> handle(gd, owner, name);
-			if (handle.isValid())
-			{
-				for (int i = 0; i < size; ++i)
-				{
-					GA_Offset offset = off + i;
-					handle.set(offset, (const T)outputlist[i]);
-				}
-				return true;
-			}
-			else
-			{
-				VRAYwarningOnce("CVEX %s as runtype %d: Handle for attribute %s is not valid.", inputcvex.c_str(), cvex_runtype, name.c_str());
-				return false;
-			}
-		}
-
-		/// type handlers
-		// type handler matching geo attrib to cvex type
-		CVEX_Type attrib2CVEXTypeHandler(GA_Attribute* attrib);
-
-		// type handler matching hdk type to cvex type
-		template <typename T>
-		inline CVEX_Type type2CVEXTypeHandler()
-		{
-			if (std::is_same<T, UT_Vector3>::value) { return CVEX_TYPE_VECTOR3; }
-			if (std::is_same<T, fpreal32>::value) { return CVEX_TYPE_FLOAT; }
-			if (std::is_same<T, UT_Vector4>::value) { return CVEX_TYPE_VECTOR4; }
-			if (std::is_same<T, int>::value) { return CVEX_TYPE_INTEGER; }
-			return CVEX_TYPE_INVALID;
-		}
-	};
-
-}
-
-#endif
+
+#ifndef __RAY_Deformer__
+#define __RAY_Deformer__
+
+#include <UT/UT_BoundingBox.h>
+#include <UT/UT_String.h>
+#include <UT/UT_ThreadedAlgorithm.h>
+#include <UT/UT_Lock.h>
+#include <UT/UT_PtrArray.h>
+#include <UT/UT_TaskScope.h>
+#include <UT/UT_Thread.h>
+#include <UT/UT_Array.h>
+#include <UT/UT_Interrupt.h>
+#include <UT/UT_ParallelUtil.h>
+#include <UT/UT_StopWatch.h>
+#include <UT/UT_WorkBuffer.h>
+#include <UT/UT_Matrix4.h>
+#include <UT/UT_Quaternion.h>
+
+#include <VRAY/VRAY_Procedural.h>
+#include <VRAY/VRAY_IO.h>
+#include <VRAY/VRAY_ProceduralFactory.h>
+
+#include <CVEX/CVEX_Context.h>
+#include <CVEX/CVEX_Value.h>
+#include <CVEX/CVEX_ValueList.h>
+#include <VEX/VEX_Error.h>
+#include <GVEX/GVEX_GeoCommand.h>
+
+#include <GA/GA_Handle.h>
+#include <GA/GA_PageHandle.h>
+#include <GA/GA_SplittableRange.h>
+
+#include <GU/GU_Detail.h>
+#include <GEO/GEO_Point.h>
+#include <GEO/GEO_Vertex.h>
+#include <GEO/GEO_Primitive.h>
+#include <GEO/GEO_AttributeHandle.h>
+
+#include <GU/GU_PolyFrame.h>
+
+#include <VM/VM_SIMD.h>
+
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+#define CVEX_CHUNKS_PER_WORKER	4	// chunks per worker thread for load balance
+#define CVEX_SETUP_RATIO	8	// chunk run time vs. per-chunk setup time
+#define CVEX_MAX_NUM	4
+
+// match those with Houdini Deformer parm interface
+#define DO_POINTS	0
+#define DO_PRIMS	1
+#define DO_VERTS	2
+#define DO_DETAILS	3
+
+// normal recompute after the stages
+#define NORMALS_SKIP	0
+#define NORMALS_FULL	1
+#define NORMALS_DIRTY	2	// only around points that moved: every P writer is masked
+
+namespace HDK_Deform
+{
+
+	// contiguous run of element offsets, never crosses a GA page
+	struct CVEXBlock
+	{
+		GA_Offset start;
+		int size;
+		int segment;	// batched segments: index of the segment detail the block belongs to
+
+		CVEXBlock(GA_Offset start, int size, int segment = 0) :
+			start(start),
+			size(size),
+			segment(segment)
+		{}
+	};
+
+	// elements processed by one cvex task: offset blocks marshalled back to back, gaps between them skipped
+	struct CVEXChunk
+	{
+		std::vector<CVEXBlock> blocks;
+		int size;	// total elements of all blocks
+
+		CVEXChunk() :
+			size(0)
+		{}
+
+		void append(const CVEXBlock& block)
+		{
+			blocks.push_back(block);
+			size += block.size;
+		}
+	};
+
+	struct CVEXExtraAttribMap
+	{
+		std::unordered_map<UT_StringHolder, UT_Vector3> vec3AttribMap;
+		std::unordered_map<UT_StringHolder, fpreal32> floatAttribMap;
+		std::unordered_map<UT_StringHolder, UT_Vector4> vec4AttribMap;
+		std::unordered_map<UT_StringHolder, int> intAttribMap;
+	};
+
+	// inputs a cvex stage actually reads, found by loading the program once
+	struct CVEXStageInfo
+	{
+		bool reads_instance = false;
+		bool reads_shutter = false;
+		bool reads_world = false;	// instancexform or worldP: result depends on the placement
+		bool probe_failed = false;	// program couldn't be loaded: it may read and write anything
+		std::vector<UT_StringHolder> extras;	// extra uniform attributes read
+		std::vector<UT_StringHolder> params;	// declared uniform inputs it binds, geometry attributes are probed per table
+		std::vector<UT_StringHolder> exports;	// exported parameters: attributes it writes
+	};
+
+	// elements a stage runs over: all, a group of the run type owner, or "@attr<op>value" on its first component
+	// unselected elements are not marshalled and keep their values
+	struct CVEXStageMask
+	{
+		UT_StringHolder source;
+		UT_StringHolder group;
+		UT_StringHolder attrib;
+		std::string op;	// >, <, >=, <=, ==, !=
+		fpreal64 value = 0.0;
+
+		bool isEmpty() const { return !source.isstring(); }
+		bool parse(const UT_StringHolder& str);
+		// selected elements of a run type
+		GA_Range range(int runtype, const GU_Detail *gd) const;
+	};
+
+	// attributes and groups a loaded source keeps: those a stage binds, a mask or the deformer reads, and the keep list
+	// the file is read and parsed in full, the filter trims what the deform and the waiting children hold
+	struct RAY_AttribFilter
+	{
+		bool keep_all = false;	// a stage couldn't be probed and may bind anything
+		std::unordered_map<std::string, bool> needed;	// read outside the stages
+		UT_StringHolder keep;	// patterns
+		std::vector<std::pair<UT_StringHolder, int>> stages;	// command and run type of each cvex stage
+
+		void add(const UT_StringHolder& name) { if (name.isstring()) { needed[name.toStdString()] = true; } }
+		// drop the rest from a freshly loaded detail
+		void apply(GU_Detail *gd, const UT_StringHolder& file) const;
+		// identity of what is kept, details filtered alike share a cache entry
+		std::string key() const;
+
+	private:
+		// attributes the stages bind, probed once per attribute table: instances of an asset share it
+		bool boundAttribs(GU_Detail *gd, std::unordered_map<std::string, bool>& names) const;
+		mutable std::mutex lock;
+		mutable std::unordered_map<std::string, std::unordered_map<std::string, bool>> bound_tables;	// empty entry: a stage failed to load
+	};
+
+	// page handles of the cvex value types marshalled per block
+	template <typename T> struct CVEXPageHandle;
+	template <> struct CVEXPageHandle<fpreal32>		{ typedef GA_ROPageHandleF RO; typedef GA_RWPageHandleF RW; };
+	template <> struct CVEXPageHandle<int>			{ typedef GA_ROPageHandleI RO; typedef GA_RWPageHandleI RW; };
+	template <> struct CVEXPageHandle<UT_Vector3>	{ typedef GA_ROPageHandleV3 RO; typedef GA_RWPageHandleV3 RW; };
+	template <> struct CVEXPageHandle<UT_Vector4>	{ typedef GA_ROPageHandleV4 RO; typedef GA_RWPageHandleV4 RW; };
+
+	// states of assets after their instance-independent leading stages,
+	// owned by one parent procedural and shared by its children
+	struct RAY_AssetStages
+	{
+		enum Status
+		{
+			EMPTY = 0,
+			BUILDING,
+			READY
+		};
+		struct Entry
+		{
+			Status status = EMPTY;
+			GU_DetailHandle state;
+		};
+		std::mutex lock;	// guards the map and entry status, never held while deforming
+		std::unordered_map<std::string, Entry> entries;
+		std::atomic<int> hits{ 0 };
+		std::atomic<int> builds{ 0 };
+	};
+
+	class RAY_DeformKernel;
+	typedef std::vector<std::shared_ptr<RAY_DeformKernel>> RAY_DeformKernelList;
+
+	class RAY_Deform : public VRAY_Procedural
+	{
+	public:
+		RAY_Deform(const UT_Matrix4D& xform, UT_StringHolder infile, GU_Detail* ingd, 
+			const std::vector<UT_StringHolder>& cfiles, const CVEXExtraAttribMap& cextra, 
+			const std::vector<int>& cruntypes, const RAY_DeformKernelList& ckernels, 
+			const std::vector<CVEXStageMask>& cmasks, const std::vector<CVEXStageInfo>& cinfos, int cvexn, int isMultiT, int ins,
+			int compN, int isVB, int isDVB, int geoTSample, int batchSeg, 
+			std::shared_ptr<RAY_AssetStages> assetStages, int compress, 
+			std::shared_ptr<const RAY_AttribFilter> filter, int stripAttribs, const UT_StringHolder& keepAttribs, 
+			fpreal open, fpreal close, fpreal fps, 
+			const int* polyframeflags, const GU_PolyFrameParms& pf_parms, 
+			std::shared_ptr<const std::atomic<bool>> interrupt);
+		virtual ~RAY_Deform();
+		virtual const char *className() const;
+		virtual int initialize(const UT_BoundingBox *);
+		virtual void getBoundingBox(UT_BoundingBox &box);
+		virtual void render();
+
+		// place the deformed geometry again, as an instance with object transform xform
+		void addPlacement(const UT_Matrix4D& xform);
+		int placementNum() const { return (int)placements.size(); }
+		// cooperative cancellation: latches once the parent saw mantra ask to stop (ipr edit, abort)
+		bool checkInterrupt();
+		bool isInterrupted() const { return is_interrupted; }
+		int discardedChunks() const { return discarded_chunks; }
+		// load a cvex stage with the uniform inputs declared and record which ones it reads
+		static bool probeCVEX(const UT_StringHolder& cvexfile, const CVEXExtraAttribMap& extras, CVEXStageInfo& info);
+		// load a cvex stage with the attributes of its run type owner declared, as a run would, and record the bound ones
+		static bool probeGeoAttribs(const UT_StringHolder& cvexfile, int runtype, GU_Detail *gd, std::unordered_map<std::string, bool>& names);
+		// what a source loaded for these stages keeps, shared by the children and the prefetching loader
+		static std::shared_ptr<RAY_AttribFilter> attribFilter(const std::vector<CVEXStageInfo>& stageinfos, 
+			const std::vector<UT_StringHolder>& cfiles, const std::vector<int>& cruntypes, 
+			const std::vector<CVEXStageMask>& cmasks, int isVB, const int* polyframeflags, int cvexn, 
+			const GU_PolyFrameParms& pf_parms, const UT_StringHolder& keepAttribs);
+
+	private:
+		bool isSuccess;	// success status for this procedural preprocessing
+		std::atomic<bool> is_interrupted;
+		std::shared_ptr<const std::atomic<bool>> interrupt_flag;	// raised by the parent, the only thread asking UT_Interrupt
+		std::atomic<int> discarded_chunks;	// cvex chunks skipped after an interrupt
+		std::atomic<bool> is_geoCommanded;	// gvex commands were applied: any attribute or element count may differ per segment
+		/// geom boundingbox
+		UT_BoundingBox bbox;
+		/// input parms, owned: deform work may run after the parent's initialize returned
+		UT_Matrix4D instance_xform;	// asset space to world, applied as object transform
+		UT_Matrix4 instance_xformF;	// bound to the uniform cvex input instancexform
+		UT_StringHolder inputfile;
+		GU_Detail* prefetched_gd;	// geometry already read by the loader, owned by geo after loadGeo
+		std::vector<UT_StringHolder> cvexfiles;
+		CVEXExtraAttribMap cvex_extraAttribs;
+		std::vector<int> cvex_runtypes;
+		RAY_DeformKernelList cvex_kernels;	// native kernel of each stage, nullptr for cvex stages
+		std::vector<CVEXStageMask> cvex_masks;
+		std::vector<CVEXStageInfo> stage_infos;	// probed once by the parent for every instance
+		int instance_id;
+		int cvex_num;
+		int is_multi_threads;
+		int is_compute_normal;
+		int is_velBlur;
+		int is_deformVelBlur;	// velocity blur with v derived from deformation at shutter open/close
+		int geo_timeSample;
+		std::shared_ptr<RAY_AssetStages> asset_stage_cache;	// the parent's shared leading stage states, null when off
+		int is_batchSegments;	// run all motion segments of a stage in one cvex pass
+		int compress_mode;	// storage of waiting geometry: 0-as is, 1-constant pages, 2-fp16 attribs, 3-fp16 P too
+		int is_filterAttribs;	// drop loaded attributes and groups nothing reads
+		std::shared_ptr<const RAY_AttribFilter> attrib_filter;	// the parent's, null when off
+		int is_stripAttribs;	// drop deformed attributes the renderer doesn't need
+		UT_StringHolder keep_attribs;	// patterns kept for the renderer
+		fpreal camShutter_open;
+		fpreal camShutter_close;
+		fpreal fps;
+		int polyframe_flags[CVEX_MAX_NUM + 1];	// pre_polyframe, post_polyframe per cvex
+		GU_PolyFrameParms polyframe_parms;
+		UT_StringHolder polyframe_names[3];	// storage of the parms' tangent, bitangent and normal names
+		UT_StringHolder polyframe_uvname;
+		/// input geom
+		VRAY_ProceduralGeo geo;
+		/// motion segments, kept to compress and restore their storage
+		std::vector<GU_DetailHandle> segment_handles;
+		std::vector<std::pair<GA_AttributeOwner, UT_StringHolder>> quantized_attribs;	// on the base or any segment
+		std::vector<std::pair<GA_AttributeOwner, UT_StringHolder>> shared_attribs;	// no stage writes them: segments share the base's pages
+		/// point to primitive adjacency of the deformed topology, built once for dirty normals
+		std::vector<GA_Size> adj_start;
+		std::vector<GA_Offset> adj_prims;
+		/// object transforms of the instances sharing this geometry, the first one is instance_xform
+		std::vector<UT_Matrix4D> placements;
+		/// cvex parms
+		template <class T>
+		using AttribMapT = std::unordered_map<UT_StringHolder, T*>;
+		// cvex execution context of one motion segment: stack-local to the deform call, never shared,
+		// so segments and sibling children can deform concurrently
+		struct CVEXSegmentData
+		{
+			/// cvex files and run types
+			UT_StringHolder inputcvex;
+			int cvex_runtype;	// cvextype: 0-points, 1-primitives, 2-vertices
+			const CVEXStageMask* mask = nullptr;
+			bool p_only = false;	// only bind and write back P, skip stages which don't export P
+			// attributes list
+			std::vector<GA_Attribute*> geoattriblist;
+			std::vector<UT_StringHolder> cvexoutputnamelist;
+			// cvex input list: buffer to store input for each input attrib
+			std::vector<std::vector<void*>> inputbuffer;	// used for handle memory allocation
+			// cvex output list: buffer to store output for each output attrib
+			std::vector<AttribMapT<UT_Vector3>> vec3_outputbuffer;		// cvextype: CVEX_TYPE_VECTOR3
+			std::vector<AttribMapT<fpreal32>> float_outputbuffer;		// cvextype: CVEX_TYPE_FLOAT
+			std::vector<AttribMapT<UT_Vector4>> vec4_outputbuffer;		// cvextype: CVEX_TYPE_VECTOR4
+			std::vector<AttribMapT<int>> int_outputbuffer;				// cvextype: CVEX_TYPE_INTEGER
+			// gvex command queue for each chunk, kept across stages
+			std::vector<VEX_GeoCommandQueue*> geocmdpool;
+			std::vector<GU_Detail*> geocmd_gds;	// detail the commands of each queue apply to
+			// batched segments: one run covers the elements of every segment, shutter is varying
+			std::vector<GU_Detail*> batch_gds;
+			std::vector<fpreal32> batch_shutters;
+			bool batch_topology = false;	// a batched stage created geometry: segments may differ from here on
+		};
+
+		int preprocess();
+		void deformSegment(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter, int first_stage);
+		// all segments through each stage at once, elements of the segments side by side
+		void deformBatched(std::vector<GU_Detail*>& gdlist, std::vector<fpreal32>& shutterlist, int first_stage);
+		// run cvex stages [begin, end) with their polyframes
+		void runStages(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter, int begin, int end);
+		// run stage i as a native kernel, false if it is a cvex stage
+		bool runKernel(int i, GU_Detail *gd);
+		// inputs read by every stage, conservative when a program can't be probed
+		// number of leading stages which don't read shutter: same result in every segment
+		int invariantStages(const std::vector<CVEXStageInfo>& stageinfos);
+		// number of leading stages which read no instance input: same result for every instance of the asset
+		int instanceIndependentStages(const std::vector<CVEXStageInfo>& stageinfos);
+		// shared state key: asset, the shared stages and everything shaping the geometry they see
+		std::string assetStateKey(fpreal32 shutter, int stage_num, bool time_dep);
+		// the asset's state if an instance already built it
+		GU_DetailHandle findAssetState(const std::string& key);
+		// replace gd by the asset's state after its first stage_num stages, built from source on first use
+		bool assetState(GU_Detail *gd, const GU_Detail& source, fpreal32 shutter, int stage_num, bool time_dep);
+		void resizeBuffer(CVEXSegmentData& sd, int chunk_num);
+		void cleanBuffer(CVEXSegmentData& sd);
+		
+		// load the source, filtered when filter is given: unread attributes never reach the deform
+		bool loadGeo(const RAY_AttribFilter* filter);
+		// how normals are recomputed from what the stages write, NORMALS_*
+		int normalMode(const std::vector<CVEXStageInfo>& stageinfos, const GU_Detail *gd);
+		// point normals of every segment: GU_Detail::normal(), or only around the moved points when dirty_only
+		void computeNormals(std::vector<GU_Detail*>& gdlist, bool dirty_only);
+		// keep only P, velocity and keep-list attributes on the deformed segments, in 32 bit storage
+		void stripAttribs(std::vector<GU_Detail*>& gdlist, const std::vector<CVEXStageInfo>& stageinfos);
+		void geoBBox(const GU_Detail *gd, UT_BoundingBox& box);
+		// velocity blur times around the rendered P, in frames
+		void velocityBlurWindow(fpreal& preBlur, fpreal& postBlur) const;
+		void velBBox(const GU_Detail *gd, UT_BoundingBox& box);
+		void polyFrame(GU_Detail *gd);
+		// shrink deformed geometry while it waits for render(), restore before addGeometry
+		// the base is converted, segments share its converted pages for the attributes no stage writes
+		void compressGeo(std::vector<GU_Detail*>& gdlist, const std::vector<CVEXStageInfo>& stageinfos);
+		bool compressAttrib(GU_Detail *gd, GA_Attribute* attrib);
+		void uncompressGeo(std::vector<GU_Detail*>& gdlist);
+		// attributes the stages, polyframe or normals may write: they differ between segments
+		// false when a stage couldn't be probed, geometry commands ran or a segment's topology differs from the base:
+		// any attribute may have been written
+		bool writtenAttribs(const std::vector<GU_Detail*>& gdlist, const std::vector<CVEXStageInfo>& stageinfos, std::unordered_map<std::string, bool>& written);
+		// re-run the P-writing stages at shutter close and derive v from the displacement
+		void deformVelocity(CVEXSegmentData& sd, GU_Detail *gd, GA_Attribute* restP, GA_Offset rest_end, int first_stage);
+
+		/// cvex
+		void executeCVEX(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter);
+		// cvex processing
+		bool processCVEX(CVEXSegmentData& sd, CVEX_Context &context, CVEX_RunData &rundata, GU_Detail *gd, const CVEXChunk& chunk, int tid, fpreal32* shutter);
+		// process a detail stage in the caller's thread with single values bound in place
+		void executeDetailCVEX(CVEXSegmentData& sd, GU_Detail *gd, fpreal32* shutter);
+		// process one chunk of cvex, chunks run as parallel tasks; optionally time its setup and run
+		void executeChunkCVEX(CVEXSegmentData& sd, GU_Detail *gd, int tid, const CVEXChunk& chunk, 
+			fpreal32 shutter, fpreal64* setup_time, fpreal64* run_time);
+		// element index of every element of a chunk
+		void fillProcId(const CVEXSegmentData& sd, const GU_Detail *gd, const CVEXChunk& chunk, UT_Array<exint>& procid);
+		// gvex command queues of the chunks, reused across stages
+		VEX_GeoCommandQueue* acquireGeoCommand(CVEXSegmentData& sd, GU_Detail *gd, int tid);
+		void applyGeoCommand(CVEXSegmentData& sd, GU_Detail *gd, int chunk_num);
+		void releaseGeoCommand(CVEXSegmentData& sd);
+		// get geom attributes
+		void getGeomAttribs(CVEXSegmentData& sd, GU_Detail *gd);
+		// set cvex function inputs from geom attributes
+		void addCVEXInput(CVEXSegmentData& sd, CVEX_Context &context);
+		// load cvex function
+		bool loadCVEX(CVEXSegmentData& sd, CVEX_Context &context);
+		// find cvex function inputs and outputs, allocate memory for output results
+		void findCVEX(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, const CVEXChunk& chunk, int tid, fpreal32* shutter);
+		void findUniformCVEX(CVEX_Context &context, fpreal32* shutter);
+		// per-element shutter of a batched chunk
+		void findShutterCVEX(CVEXSegmentData& sd, CVEX_Context &context, const CVEXChunk& chunk, int tid);
+		// detail a block belongs to
+		inline GU_Detail* blockDetail(const CVEXSegmentData& sd, GU_Detail *gd, const CVEXBlock& block) const
+		{
+			return sd.batch_gds.empty() ? gd : sd.batch_gds[block.segment];
+		}
+		// world space P of a point chunk, bound only if the cvex declares worldP
+		void findWorldPCVEX(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, const CVEXChunk& chunk, int tid);
+		void setCVEXOutput(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, const CVEXChunk& chunk, int tid);
+		// own copies of the pages of an attribute about to be written in parallel
+		void hardenAttrib(GU_Detail *gd, GA_AttributeOwner owner, const UT_StringHolder& name);
+		// create new output
+		void createGeomAttribFromCVEXOutput(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd);
+
+		// cvex find typed input and output
+		template <typename T>
+		inline void findTypedUniformInput(CVEX_Context &context, UT_StringHolder name, T* value)
+		{
+			CVEX_Value* var;
+			CVEX_Type type = type2CVEXTypeHandler<T>();
+			var = context.findInput(name, type);
+			if (var)
+			{
+				var->setTypedData(value, 1);
+			}
+		}
+
+		template <typename T>
+		inline void findTypedCVEX(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, std::vector<AttribMapT<T>>& attriblist, const CVEXChunk& chunk, int tid)
+		{
+			GA_AttributeOwner owner;
+			switch (sd.cvex_runtype)
+			{
+			case DO_POINTS:
+			{
+				owner = GA_ATTRIB_POINT;
+				break;
+			}
+			case DO_PRIMS:
+			{
+				owner = GA_ATTRIB_PRIMITIVE;
+				break;
+			}
+			case DO_VERTS:
+			{
+				owner = GA_ATTRIB_VERTEX;
+				break;
+			}
+			case DO_DETAILS:
+			{
+				owner = GA_ATTRIB_DETAIL;
+				break;
+			}
+			default:
+				VRAYerrorOnce("CVEX %s as runtype %d: Cannot identify CVEX run type.", sd.inputcvex.c_str(), sd.cvex_runtype);
+				return;
+			}
+
+			CVEX_Value* val;
+			CVEX_Value* out;
+			CVEX_Type type = type2CVEXTypeHandler<T>();
+
+			T* attr_list;
+			T* attr_outlist;
+
+			for (auto attrib : sd.geoattriblist)
+			{
+				// check to see whether VEX function has the correspoonding parameter
+				val = context.findInput(attrib->getName(), type);
+				// if input, allocate memory and set input data
+				if (val)
+				{
+					// allocate memory for input attrib
+					attr_list = new T[chunk.size];
+					sd.inputbuffer[tid].push_back((void*)attr_list);
+					// set attrib to buffer
+					getTypedAttribByGeom(sd, gd, attrib->getName(), attr_list, owner, chunk);
+					// set cvex input
+					val->setTypedData(attr_list, chunk.size);
+					// RAYprintf(0, "Set input attrib %s.", attrib->getName().c_str());
+				}
+			}
+
+			for (auto name : sd.cvexoutputnamelist)
+			{
+				// find output of cvex
+				out = context.findOutput(name, type);
+				if (out)
+				{
+					// allocate memory for output list
+					attr_outlist = new T[chunk.size];
+					attriblist[tid][name] = attr_outlist;
+					// link memory buffer to output attrib
+					out->setTypedData(attr_outlist, chunk.size);
+					// RAYprintf(0, "Set output attrib %s.", name.c_str());
+				}
+			}
+		}
+
+		// detail values of one cvex type, bound to cvex as single values
+		template <typename T>
+		struct DetailValues
+		{
+			std::vector<T> values;
+			std::vector<std::pair<UT_StringHolder, exint>> outputs;	// output name, index into values
+		};
+
+		template <typename T>
+		inline void bindTypedDetail(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, DetailValues<T>& detail)
+		{
+			CVEX_Type type = type2CVEXTypeHandler<T>();
+			// values are bound by address: no reallocation after this point
+			detail.values.reserve(sd.geoattriblist.size() + sd.cvexoutputnamelist.size());
+
+			for (auto attrib : sd.geoattriblist)
+			{
+				CVEX_Value* val = context.findInput(attrib->getName(), type);
+				if (val)
+				{
+					GA_ROHandleT<T> handle(attrib);
+					detail.values.push_back(handle.isValid() ? handle.get(GA_Offset(0)) : T());
+					val->setTypedData(&detail.values.back(), 1);
+				}
+			}
+			for (auto name : sd.cvexoutputnamelist)
+			{
+				CVEX_Value* out = context.findOutput(name, type);
+				if (out)
+				{
+					detail.outputs.push_back(std::make_pair(name, (exint)detail.values.size()));
+					detail.values.push_back(T());
+					out->setTypedData(&detail.values.back(), 1);
+				}
+			}
+		}
+
+		template <typename T>
+		inline void writeTypedDetail(GU_Detail *gd, const DetailValues<T>& detail)
+		{
+			for (const auto &output : detail.outputs)
+			{
+				GA_RWHandleT<T> handle(gd, GA_ATTRIB_DETAIL, output.first);
+				if (handle.isValid())
+				{
+					handle.set(GA_Offset(0), detail.values[output.second]);
+				}
+			}
+		}
+
+		// set cvex typed output back to geom attributes
+		template <typename T>
+		inline void setTypedCVEXOutput(CVEXSegmentData& sd, CVEX_Context &context, GU_Detail *gd, std::vector<AttribMapT<T>>& attriblist, const CVEXChunk& chunk, int tid)
+		{
+			GA_AttributeOwner owner;
+			switch (sd.cvex_runtype)
+			{
+			case DO_POINTS:
+			{
+				owner = GA_ATTRIB_POINT;
+				break;
+			}
+			case DO_PRIMS:
+			{
+				owner = GA_ATTRIB_PRIMITIVE;
+				break;
+			}
+			case DO_VERTS:
+			{
+				owner = GA_ATTRIB_VERTEX;
+				break;
+			}
+			case DO_DETAILS:
+			{
+				owner = GA_ATTRIB_DETAIL;
+				break;
+			}
+			default:
+				VRAYerrorOnce("CVEX %s as runtype %d: Cannot identify CVEX run type.", sd.inputcvex.c_str(), sd.cvex_runtype);
+				return;
+			}
+
+			for (const auto &attribinfo : attriblist[tid])
+			{
+				CVEX_Value* out;
+				UT_StringHolder attrib_nam = attribinfo.first;
+				T* outputlist = attribinfo.second;
+				out = context.findOutput(attrib_nam, type2CVEXTypeHandler<T>());
+				setTypedAttribByGeom<T>(sd, gd, attrib_nam, outputlist, owner, chunk);
+				// RAYprintf(0, "Set attrib %s back to geom.", attrib_nam.c_str());
+			}
+		}
+
+		// get typed attributes data from input geom, block by block
+		// a block never crosses a page: each one is a single copy out of the page
+		template <typename T>
+		inline bool getTypedAttribByGeom(const CVEXSegmentData& sd, GU_Detail *gd, UT_StringHolder name, T* inputlist, GA_AttributeOwner owner, const CVEXChunk& chunk)
+		{
+			typename CVEXPageHandle<T>::RO handle(gd->findAttribute(owner, name));
+			if (handle.isValid())
+			{
+				int i = 0;
+				GU_Detail* handle_gd = gd;
+				for (const auto& block : chunk.blocks)
+				{
+					// batched: blocks of other segments read their own detail
+					GU_Detail* block_gd = blockDetail(sd, gd, block);
+					if (block_gd != handle_gd)
+					{
+						handle.bind(block_gd->findAttribute(owner, name));
+						handle_gd = block_gd;
+					}
+					handle.setPage(block.start);
+					std::copy(&handle.value(block.start), &handle.value(block.start) + block.size, inputlist + i);
+					i += block.size;
+				}
+				return true;
+			}
+			// storage differs from T: element by element through the converting handle
+			GA_ROHandleT<T> convert_h(gd->findAttribute(owner, name));
+			if (convert_h.isValid())
+			{
+				int i = 0;
+				for (const auto& block : chunk.blocks)
+				{
+					GU_Detail* block_gd = blockDetail(sd, gd, block);
+					if (block_gd != gd) { convert_h.bind(block_gd->findAttribute(owner, name)); }
+					for (GA_Offset off = block.start; off < block.start + block.size; ++off) { inputlist[i++] = convert_h.get(off); }
+					if (block_gd != gd) { convert_h.bind(gd->findAttribute(owner, name)); }
+				}
+				return true;
+			}
+			VRAYwarningOnce("CVEX %s as runtype %d: Handle for attribute %s is not valid.", sd.inputcvex.c_str(), sd.cvex_runtype, name.c_str());
+			std::fill(inputlist, inputlist + chunk.size, T());
+			return false;
+		}
+
+		// set typed attributes data to input geom, block by block
+		template <typename T>
+		inline bool setTypedAttribByGeom(const CVEXSegmentData& sd, GU_Detail *gd, UT_StringHolder name, T* outputlist, GA_AttributeOwner owner, const CVEXChunk& chunk)
+		{
+			typename CVEXPageHandle<T>::RW handle(gd->findAttribute(owner, name));
+			if (handle.isValid())
+			{
+				int i = 0;
+				GU_Detail* handle_gd = gd;
+				for (const auto& block : chunk.blocks)
+				{
+					GU_Detail* block_gd = blockDetail(sd, gd, block);
+					if (block_gd != handle_gd)
+					{
+						handle.bind(block_gd->findAttribute(owner, name));
+						handle_gd = block_gd;
+					}
+					handle.setPage(block.start);
+					std::copy(outputlist + i, outputlist + i + block.size, &handle.value(block.start));
+					i += block.size;
+				}
+				return true;
+			}
+			// storage differs from T: element by element through the converting handle
+			GA_RWHandleT<T> convert_h(gd->findAttribute(owner, name));
+			if (convert_h.isValid())
+			{
+				int i = 0;
+				for (const auto& block : chunk.blocks)
+				{
+					GU_Detail* block_gd = blockDetail(sd, gd, block);
+					if (block_gd != gd) { convert_h.bind(block_gd->findAttribute(owner, name)); }
+					for (GA_Offset off = block.start; off < block.start + block.size; ++off) { convert_h.set(off, outputlist[i++]); }
+					if (block_gd != gd) { convert_h.bind(gd->findAttribute(owner, name)); }
+				}
+				return true;
+			}
+			VRAYwarningOnce("CVEX %s as runtype %d: Handle for attribute %s is not valid.", sd.inputcvex.c_str(), sd.cvex_runtype, name.c_str());
+			return false;
+		}
+
+		/// type handlers
+		// type handler matching geo attrib to cvex type
+		static CVEX_Type attrib2CVEXTypeHandler(GA_Attribute* attrib);
+
+		// type handler matching hdk type to cvex type
+		template <typename T>
+		inline CVEX_Type type2CVEXTypeHandler()
+		{
+			if (std::is_same<T, UT_Vector3>::value) { return CVEX_TYPE_VECTOR3; }
+			if (std::is_same<T, fpreal32>::value) { return CVEX_TYPE_FLOAT; }
+			if (std::is_same<T, UT_Vector4>::value) { return CVEX_TYPE_VECTOR4; }
+			if (std::is_same<T, int>::value) { return CVEX_TYPE_INTEGER; }
+			if (std::is_same<T, UT_Matrix4>::value) { return CVEX_TYPE_MATRIX4; }
+			return CVEX_TYPE_INVALID;
+		}
+	};
+
+}
+
+#endif